@@ -0,0 +1,564 @@
+// Self-contained benchmark of BucketStorage against std::vector, std::list,
+// std::deque and a small colony-style container.
+//
+//   g++ -std=c++20 -O2 -DNDEBUG -I. bench.cpp -o bench
+//   ./bench [--quick] [filter]
+//
+// Every case runs in a forked child, so the reported peak RSS belongs to
+// that case alone. Latencies are sampled on every 16th operation; for
+// whole-container operations (iteration, shrink_to_fit, copy, move) one
+// operation is one pass over the container.
+
+#include "bucket_storage.hpp"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace
+{
+	using Clock = std::chrono::steady_clock;
+	using Rng = std::mt19937_64;
+
+	template< std::size_t N >
+	struct Payload
+	{
+		std::uint64_t key{ 0 };
+		std::array< unsigned char, N - sizeof(std::uint64_t) > pad{};
+
+		Payload() = default;
+		explicit Payload(std::uint64_t new_key) : key(new_key) {}
+	};
+
+	// Colony-style reference: geometrically growing groups with a skip flag
+	// per slot and a free list of erased slots, so erase keeps every other
+	// element in place.
+	template< typename T >
+	class MiniColony
+	{
+	  public:
+		using value_type = T;
+
+		struct Handle
+		{
+			std::size_t group;
+			std::size_t slot;
+		};
+
+	  private:
+		struct Group
+		{
+			std::unique_ptr< unsigned char[] > storage;
+			std::unique_ptr< bool[] > erased;
+			std::size_t capacity{ 0 };
+			std::size_t used{ 0 };
+
+			explicit Group(std::size_t new_capacity) :
+				storage(new unsigned char[new_capacity * sizeof(T)]), erased(new bool[new_capacity]()), capacity(new_capacity)
+			{
+			}
+
+			T* at(std::size_t slot) const noexcept { return std::launder(reinterpret_cast< T* >(storage.get()) + slot); }
+		};
+
+		std::vector< Group > groups_;
+		std::vector< Handle > free_;
+		std::size_t size_{ 0 };
+
+	  public:
+		MiniColony() = default;
+		MiniColony(const MiniColony& other) : free_(other.free_), size_(other.size_)
+		{
+			groups_.reserve(other.groups_.size());
+			for (const Group& group : other.groups_)
+			{
+				Group& copy = groups_.emplace_back(group.capacity);
+				copy.used = group.used;
+				std::copy(group.erased.get(), group.erased.get() + group.used, copy.erased.get());
+				for (std::size_t slot = 0; slot < group.used; ++slot)
+					if (!group.erased[slot])
+						::new (static_cast< void* >(copy.at(slot))) T(*group.at(slot));
+			}
+		}
+		MiniColony(MiniColony&& other) noexcept = default;
+		MiniColony& operator=(const MiniColony& other) = delete;
+		MiniColony& operator=(MiniColony&& other) noexcept = default;
+
+		~MiniColony()
+		{
+			for (Group& group : groups_)
+				for (std::size_t slot = 0; slot < group.used; ++slot)
+					if (!group.erased[slot])
+						group.at(slot)->~T();
+		}
+
+		Handle insert(const T& value)
+		{
+			if (!free_.empty())
+			{
+				const Handle handle = free_.back();
+				Group& group = groups_[handle.group];
+				::new (static_cast< void* >(group.at(handle.slot))) T(value);
+				group.erased[handle.slot] = false;
+				free_.pop_back();
+				++size_;
+				return handle;
+			}
+
+			if (groups_.empty() || groups_.back().used == groups_.back().capacity)
+				groups_.emplace_back(groups_.empty() ? 8 : std::min< std::size_t >(groups_.back().capacity * 2, 8192));
+
+			Group& group = groups_.back();
+			::new (static_cast< void* >(group.at(group.used))) T(value);
+			++size_;
+			return { groups_.size() - 1, group.used++ };
+		}
+
+		void erase(Handle handle)
+		{
+			Group& group = groups_[handle.group];
+			group.at(handle.slot)->~T();
+			group.erased[handle.slot] = true;
+			free_.push_back(handle);
+			--size_;
+		}
+
+		template< typename F >
+		void for_each(F&& visit) const
+		{
+			for (const Group& group : groups_)
+				for (std::size_t slot = 0; slot < group.used; ++slot)
+					if (!group.erased[slot])
+						visit(*group.at(slot));
+		}
+
+		std::size_t size() const noexcept { return size_; }
+	};
+
+	// Uniform surface for the scenarios: insert, erase of a random element,
+	// a full read pass, shrink and whole-container copy/move.
+	template< typename Container >
+	class SequenceAdapter
+	{
+	  private:
+		Container container_;
+
+	  public:
+		using value_type = typename Container::value_type;
+
+		void insert(const value_type& value) { container_.push_back(value); }
+
+		// Unordered erase: the usual way to drop an arbitrary element
+		// without shifting the tail.
+		void erase_random(Rng& rng)
+		{
+			auto position = container_.begin() + static_cast< std::ptrdiff_t >(rng() % container_.size());
+			*position = std::move(container_.back());
+			container_.pop_back();
+		}
+
+		std::uint64_t sum() const
+		{
+			std::uint64_t result = 0;
+			for (const value_type& value : container_)
+				result += value.key;
+			return result;
+		}
+
+		void shrink() { container_.shrink_to_fit(); }
+		std::size_t size() const noexcept { return container_.size(); }
+		const Container& container() const noexcept { return container_; }
+		Container& container() noexcept { return container_; }
+	};
+
+	template< typename Container, typename HandleOf >
+	class NodeAdapter
+	{
+	  private:
+		using handle_type = std::invoke_result_t< HandleOf, Container&, const typename Container::value_type& >;
+
+		Container container_;
+		std::vector< handle_type > handles_;
+
+	  public:
+		using value_type = typename Container::value_type;
+
+		void insert(const value_type& value) { handles_.push_back(HandleOf()(container_, value)); }
+
+		void erase_random(Rng& rng)
+		{
+			const std::size_t index = rng() % handles_.size();
+			container_.erase(handles_[index]);
+			handles_[index] = handles_.back();
+			handles_.pop_back();
+		}
+
+		std::uint64_t sum() const
+		{
+			std::uint64_t result = 0;
+			if constexpr (requires { container_.for_each([](const value_type&) {}); })
+				container_.for_each([&result](const value_type& value) { result += value.key; });
+			else
+				for (const value_type& value : container_)
+					result += value.key;
+			return result;
+		}
+
+		// Only called for containers with shrink_to_fit(), which moves every
+		// element, so the handles are collected again.
+		void shrink()
+		{
+			container_.shrink_to_fit();
+			handles_.clear();
+			for (auto it = container_.begin(); it != container_.end(); ++it)
+				handles_.push_back(it);
+		}
+
+		std::size_t size() const noexcept { return container_.size(); }
+		const Container& container() const noexcept { return container_; }
+		Container& container() noexcept { return container_; }
+	};
+
+	struct ListInsert
+	{
+		template< typename T >
+		auto operator()(std::list< T >& list, const T& value) const
+		{
+			return list.insert(list.end(), value);
+		}
+	};
+
+	struct ColonyInsert
+	{
+		template< typename T >
+		auto operator()(MiniColony< T >& colony, const T& value) const
+		{
+			return colony.insert(value);
+		}
+	};
+
+	struct StorageInsert
+	{
+		template< typename T >
+		auto operator()(BucketStorage< T >& storage, const T& value) const
+		{
+			return storage.insert(value);
+		}
+	};
+
+	template< typename T >
+	using VectorAdapter = SequenceAdapter< std::vector< T > >;
+	template< typename T >
+	using DequeAdapter = SequenceAdapter< std::deque< T > >;
+	template< typename T >
+	using ListAdapter = NodeAdapter< std::list< T >, ListInsert >;
+	template< typename T >
+	using ColonyAdapter = NodeAdapter< MiniColony< T >, ColonyInsert >;
+
+	template< typename T, std::size_t BlockCapacity, std::size_t MaxBlockCapacity = BlockCapacity >
+	class StorageAdapter : public NodeAdapter< BucketStorage< T >, StorageInsert >
+	{
+	  public:
+		StorageAdapter() { this->container() = BucketStorage< T >(BlockCapacity, MaxBlockCapacity); }
+	};
+
+	struct Result
+	{
+		std::size_t operations{ 0 };
+		double seconds{ 0.0 };
+		std::vector< std::uint64_t > samples;
+	};
+
+	volatile std::uint64_t sink = 0;
+
+	// Runs op() count times, timing every 16th call on its own.
+	template< typename Op >
+	void measure(Result& result, std::size_t count, Op&& op)
+	{
+		const auto start = Clock::now();
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			if (i % 16 == 0)
+			{
+				const auto op_start = Clock::now();
+				op();
+				result.samples.push_back(static_cast< std::uint64_t >((Clock::now() - op_start).count()));
+			}
+			else
+				op();
+		}
+		result.seconds += std::chrono::duration< double >(Clock::now() - start).count();
+		result.operations += count;
+	}
+
+	// Whole-container operations: every call is timed.
+	template< typename Op >
+	void measure_each(Result& result, Op&& op)
+	{
+		const auto start = Clock::now();
+		op();
+		const auto elapsed = Clock::now() - start;
+		result.samples.push_back(static_cast< std::uint64_t >(elapsed.count()));
+		result.seconds += std::chrono::duration< double >(elapsed).count();
+		++result.operations;
+	}
+
+	template< typename Adapter >
+	void fill(Adapter& adapter, std::size_t count)
+	{
+		using value_type = typename Adapter::value_type;
+		for (std::size_t i = 0; i < count; ++i)
+			adapter.insert(value_type(i));
+	}
+
+	template< typename Adapter >
+	Result insert_only(std::size_t n)
+	{
+		using value_type = typename Adapter::value_type;
+		Result result;
+		for (int round = 0; round < 3; ++round)
+		{
+			Adapter adapter;
+			std::uint64_t key = 0;
+			measure(result, n, [&] { adapter.insert(value_type(key++)); });
+		}
+		return result;
+	}
+
+	template< typename Adapter >
+	Result churn(std::size_t n)
+	{
+		using value_type = typename Adapter::value_type;
+		Rng rng(42);
+		Adapter adapter;
+		fill(adapter, n);
+
+		Result result;
+		std::uint64_t key = n;
+		measure(result,
+				n * 2,
+				[&]
+				{
+					adapter.erase_random(rng);
+					adapter.insert(value_type(key++));
+				});
+		return result;
+	}
+
+	template< typename Adapter >
+	Result iterate(std::size_t n, double fill_ratio)
+	{
+		Rng rng(42);
+		Adapter adapter;
+		fill(adapter, n);
+		while (static_cast< double >(adapter.size()) > static_cast< double >(n) * fill_ratio)
+			adapter.erase_random(rng);
+
+		Result result;
+		for (int pass = 0; pass < 20; ++pass)
+			measure_each(result, [&] { sink = sink + adapter.sum(); });
+		return result;
+	}
+
+	template< typename Adapter >
+	Result shrink(std::size_t n)
+	{
+		Result result;
+		for (int round = 0; round < 10; ++round)
+		{
+			Rng rng(round);
+			Adapter adapter;
+			fill(adapter, n);
+			while (adapter.size() > n / 4)
+				adapter.erase_random(rng);
+
+			measure_each(result, [&] { adapter.shrink(); });
+		}
+		return result;
+	}
+
+	template< typename Adapter >
+	Result copy(std::size_t n)
+	{
+		Adapter adapter;
+		fill(adapter, n);
+
+		Result result;
+		for (int round = 0; round < 10; ++round)
+			measure_each(result,
+						 [&]
+						 {
+							 auto copy = adapter.container();
+							 sink = sink + copy.size();
+						 });
+		return result;
+	}
+
+	// Destruction of a filled container, the cost paid on every teardown.
+	template< typename Adapter >
+	Result teardown(std::size_t n)
+	{
+		Result result;
+		for (int round = 0; round < 10; ++round)
+		{
+			auto adapter = std::make_unique< Adapter >();
+			fill(*adapter, n);
+			measure_each(result, [&] { adapter.reset(); });
+		}
+		return result;
+	}
+
+	template< typename Adapter >
+	Result move(std::size_t n)
+	{
+		Adapter adapter;
+		fill(adapter, n);
+
+		Result result;
+		for (int round = 0; round < 1000; ++round)
+			measure_each(result,
+						 [&]
+						 {
+							 auto moved = std::move(adapter.container());
+							 adapter.container() = std::move(moved);
+						 });
+		return result;
+	}
+
+	std::uint64_t percentile(std::vector< std::uint64_t >& samples, double quantile)
+	{
+		if (samples.empty())
+			return 0;
+		const auto index = static_cast< std::size_t >(quantile * static_cast< double >(samples.size() - 1));
+		std::nth_element(samples.begin(), samples.begin() + static_cast< std::ptrdiff_t >(index), samples.end());
+		return samples[index];
+	}
+
+	struct Case
+	{
+		std::string name;
+		std::function< Result() > run;
+	};
+
+	void report(const std::string& name, Result result)
+	{
+		rusage usage{};
+		getrusage(RUSAGE_SELF, &usage);
+
+		const std::uint64_t p50 = percentile(result.samples, 0.50);
+		const std::uint64_t p99 = percentile(result.samples, 0.99);
+		std::printf("%-48s %12.3f %12llu %12llu %10ld\n",
+					name.c_str(),
+					static_cast< double >(result.operations) / result.seconds / 1e6,
+					static_cast< unsigned long long >(p50),
+					static_cast< unsigned long long >(p99),
+					usage.ru_maxrss);
+		std::fflush(stdout);
+	}
+
+	template< typename Adapter >
+	void add_container(std::vector< Case >& cases, const std::string& prefix, std::size_t n)
+	{
+		cases.push_back({ prefix + "/insert", [n] { return insert_only< Adapter >(n); } });
+		cases.push_back({ prefix + "/churn", [n] { return churn< Adapter >(n); } });
+		for (const double ratio : { 1.0, 0.5, 0.1 })
+		{
+			const std::string suffix = "/iterate_" + std::to_string(static_cast< int >(ratio * 100)) + "%";
+			cases.push_back({ prefix + suffix, [n, ratio] { return iterate< Adapter >(n, ratio); } });
+		}
+		if constexpr (requires(Adapter adapter) { adapter.container().shrink_to_fit(); })
+			cases.push_back({ prefix + "/shrink_to_fit", [n] { return shrink< Adapter >(n); } });
+		cases.push_back({ prefix + "/copy", [n] { return copy< Adapter >(n); } });
+		cases.push_back({ prefix + "/move", [n] { return move< Adapter >(n); } });
+		cases.push_back({ prefix + "/teardown", [n] { return teardown< Adapter >(n); } });
+	}
+
+	template< std::size_t PayloadSize >
+	void add_payload(std::vector< Case >& cases, bool quick)
+	{
+		using T = Payload< PayloadSize >;
+		// Keeps the live data around 32 MB (3 MB in quick mode).
+		std::size_t n = std::min< std::size_t >(200000, (32u << 20) / sizeof(T));
+		if (quick)
+			n /= 10;
+
+		const std::string suffix = "/" + std::to_string(PayloadSize) + "B";
+		add_container< StorageAdapter< T, 16 > >(cases, "bucket_storage_16" + suffix, n);
+		add_container< StorageAdapter< T, 64 > >(cases, "bucket_storage_64" + suffix, n);
+		add_container< StorageAdapter< T, 256 > >(cases, "bucket_storage_256" + suffix, n);
+		add_container< StorageAdapter< T, 1024 > >(cases, "bucket_storage_1024" + suffix, n);
+		add_container< StorageAdapter< T, 8, 1024 > >(cases, "bucket_storage_8-1024" + suffix, n);
+		add_container< StorageAdapter< T, BucketStorage< T >::default_block_capacity > >(cases, "bucket_storage_default" + suffix, n);
+		add_container< VectorAdapter< T > >(cases, "vector" + suffix, n);
+		add_container< DequeAdapter< T > >(cases, "deque" + suffix, n);
+		add_container< ListAdapter< T > >(cases, "list" + suffix, n);
+		add_container< ColonyAdapter< T > >(cases, "colony" + suffix, n);
+	}
+}	 // namespace
+
+int main(int argc, char** argv)
+{
+	bool quick = false;
+	std::string filter;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (std::strcmp(argv[i], "--quick") == 0)
+			quick = true;
+		else
+			filter = argv[i];
+	}
+
+	std::vector< Case > cases;
+	add_payload< 8 >(cases, quick);
+	add_payload< 64 >(cases, quick);
+	add_payload< 256 >(cases, quick);
+	add_payload< 1024 >(cases, quick);
+
+	std::printf("%-48s %12s %12s %12s %10s\n", "case", "Mops/s", "p50 ns", "p99 ns", "rss KB");
+	std::fflush(stdout);
+
+	int failures = 0;
+	for (const Case& bench : cases)
+	{
+		if (!filter.empty() && bench.name.find(filter) == std::string::npos)
+			continue;
+
+		const pid_t child = fork();
+		if (child < 0)
+		{
+			std::perror("fork");
+			return 1;
+		}
+		if (child == 0)
+		{
+			report(bench.name, bench.run());
+			std::_Exit(0);
+		}
+
+		int status = 0;
+		waitpid(child, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		{
+			std::fprintf(stderr, "%s failed\n", bench.name.c_str());
+			++failures;
+		}
+	}
+
+	return failures == 0 ? 0 : 1;
+}
@@ -1,545 +1,811 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <future>
 #include <iterator>
+#include <memory>
+#include <new>
+#include <optional>
 #include <stdexcept>
+#include <string>
+#include <type_traits>
 #include <utility>
+#include <vector>
 
 template< typename T >
-class NodeStack
+struct Element
 {
+  public:
+	using size_type = std::size_t;
+	static constexpr size_type npos = static_cast< size_type >(-1);
+
   private:
-	T value_{};
-	NodeStack* previous_{ nullptr };
+	size_type next_{ npos };
+	size_type previous_{ npos };
+	std::uint32_t generation_{ 0 };
+	bool is_active_{ false };
 
   public:
-	explicit NodeStack(const T& value);
-	T getValue();
-	NodeStack* getPrevious() noexcept;
-	NodeStack* setPrevious(NodeStack* prev) noexcept;
+	[[nodiscard]] bool isActive() const noexcept;
+	[[nodiscard]] size_type getNext() const noexcept;
+	[[nodiscard]] size_type getPrevious() const noexcept;
+	[[nodiscard]] std::uint32_t getGeneration() const noexcept;
+
+	void setIsActive(bool is_active) noexcept;
+	void setNext(size_type next) noexcept;
+	void setPrevious(size_type previous) noexcept;
+	void nextGeneration() noexcept;
 };
 
 template< typename T >
-NodeStack< T >::NodeStack(const T& value) : value_(value)
+bool Element< T >::isActive() const noexcept
 {
+	return is_active_;
 }
 
 template< typename T >
-T NodeStack< T >::getValue()
+typename Element< T >::size_type Element< T >::getNext() const noexcept
 {
-	return value_;
+	return next_;
 }
 
 template< typename T >
-NodeStack< T >* NodeStack< T >::getPrevious() noexcept
+typename Element< T >::size_type Element< T >::getPrevious() const noexcept
 {
 	return previous_;
 }
 
 template< typename T >
-NodeStack< T >* NodeStack< T >::setPrevious(NodeStack* prev) noexcept
+std::uint32_t Element< T >::getGeneration() const noexcept
 {
-	previous_ = prev;
-	return previous_;
+	return generation_;
 }
 
 template< typename T >
-class Stack
-{
-  private:
-	using size_type = std::size_t;
-	NodeStack< T >* current_{ nullptr };
-	size_type size_{ 0 };
-
-  public:
-	void add(const T& value);
-	void pop();
-	T top();
-	[[nodiscard]] bool empty() const noexcept;
-	[[nodiscard]] size_type size() const noexcept;
-	~Stack();
-};
-
-template< typename T >
-void Stack< T >::add(const T& value)
+void Element< T >::setIsActive(bool is_active) noexcept
 {
-	auto* next = new NodeStack< T >(value);
-	if (size_ > 0)
-		next->setPrevious(current_);
-
-	current_ = next;
-	++size_;
+	is_active_ = is_active;
 }
 
 template< typename T >
-void Stack< T >::pop()
+void Element< T >::setNext(size_type next) noexcept
 {
-	if (current_ != nullptr)
-	{
-		auto* temp = current_;
-		current_ = current_->getPrevious();
-		delete temp;
-		--size_;
-	}
+	next_ = next;
 }
 
 template< typename T >
-T Stack< T >::top()
+void Element< T >::setPrevious(size_type previous) noexcept
 {
-	if (current_ == nullptr)
-		throw std::runtime_error("Stack is empty");
-	return current_->getValue();
+	previous_ = previous;
 }
 
 template< typename T >
-bool Stack< T >::empty() const noexcept
+void Element< T >::nextGeneration() noexcept
 {
-	return size_ == 0;
+	++generation_;
 }
 
+// Sizing of default blocks: the largest power-of-two capacity whose block
+// (header, payload and slot metadata) fits in target_bytes, but at least
+// min_capacity slots. Specialize it to aim a type at another size, e.g.
+// 2 MB for storages backed by huge pages.
+// A non-zero inline_capacity embeds a first block of that many slots in the
+// storage object itself (needs a nothrow move constructible T).
 template< typename T >
-typename Stack< T >::size_type Stack< T >::size() const noexcept
+struct BlockSizeTraits
 {
-	return size_;
-}
+	static constexpr std::size_t target_bytes = 4096;
+	static constexpr std::size_t min_capacity = 16;
+	static constexpr std::size_t inline_capacity = 0;
+};
 
+// Specializations of BlockSizeTraits may leave inline_capacity out.
 template< typename T >
-Stack< T >::~Stack()
+constexpr std::size_t inlineBlockCapacity() noexcept
 {
-	while (current_)
-		pop();
+	if constexpr (requires { BlockSizeTraits< T >::inline_capacity; })
+		return BlockSizeTraits< T >::inline_capacity;
+	else
+		return 0;
 }
 
+// A block owns its payload and the slot metadata. Active slots form a list
+// inside the block, erased slots form a free list threaded through the same
+// links, so no pointer ever leaves the block and a block can be shared
+// between a storage and its snapshots (see references_) or cloned as a unit.
+// The header, the payload and the slot metadata share a single allocation,
+// so blocks are made with create()/clone() and freed with dispose(). Given
+// memory of allocationSize() bytes, they build an embedded block there
+// instead, which dispose() destroys without freeing.
 template< typename T >
-struct Element
+struct Block
 {
   private:
-	T* value_{ nullptr };
-	bool is_active_{ false };
-	std::size_t index_{};
-	Element* next_{ nullptr };
-	Element* previous_{ nullptr };
+	using size_type = std::size_t;
+	using element_type = Element< T >;
+	using time_point = std::chrono::steady_clock::time_point;
+	static constexpr size_type npos = element_type::npos;
+
+	Block* next_{ nullptr };
+	Block* previous_{ nullptr };
+	Block* next_deleting_{ nullptr };
+	Block* previous_deleting_{ nullptr };
+	element_type* elements_{ nullptr };
+	T* values_{ nullptr };
+	size_type block_capacity_{ 0 };
+	size_type size_{ 0 };
+	size_type used_{ 0 };
+	size_type first_{ npos };
+	size_type last_{ npos };
+	size_type deleted_cells_{ npos };
+	size_type deleted_count_{ 0 };
+	// Insertion times of the elements since the block was last empty, see
+	// stamp(); erases do not narrow it.
+	time_point oldest_{};
+	time_point newest_{};
+	std::uint32_t id_{ 0 };
+	std::uint32_t deleting_bucket_{ 0 };
+	bool embedded_{ false };
+	mutable std::atomic< size_type > references_{ 1 };
+
+	static constexpr size_type alignUp(size_type offset, size_type align) noexcept;
+	static constexpr size_type valuesOffset() noexcept;
+	static constexpr size_type elementsOffset(size_type block_capacity) noexcept;
+	static void* allocate(size_type block_capacity);
+	static void deallocate(void* memory) noexcept;
+
+	explicit Block(size_type block_capacity) noexcept;
+	Block(const Block& other) noexcept;
+	~Block();
+
+	void link(size_type index) noexcept;
+	void unlink(size_type index) noexcept;
 
   public:
-	void clear() noexcept;
-	[[nodiscard]] bool isActive() const noexcept;
-	[[nodiscard]] std::size_t getIndex() const noexcept;
-	T* getValue() const noexcept;
-	Element* getNext() const noexcept;
-	Element* getPrevious() const noexcept;
+	Block& operator=(const Block& other) = delete;
 
-	void setIsActive(bool is_active) noexcept;
-	void setIndex(std::size_t new_index) noexcept;
-	void setValue(T* value) noexcept;
-	void setNext(Element* next) noexcept;
-	void setPrevious(Element* previous) noexcept;
-
-	explicit Element() noexcept = default;
-	Element(Element&& other) noexcept;
-	Element& operator=(Element&& other) noexcept;
-	Element(const Element& other);
-	Element& operator=(const Element& other);
-	void swap(Element& other) noexcept;
+	static constexpr size_type alignment = std::max({ alignof(Block*), alignof(T), alignof(element_type) });
+
+	static constexpr size_type allocationSize(size_type block_capacity) noexcept;
+	static constexpr size_type fittingCapacity(size_type target_bytes, size_type min_capacity) noexcept;
+
+	static Block* create(size_type block_capacity, void* memory = nullptr);
+	static Block* clone(const Block& other, void* memory = nullptr);
+	static Block* relocate(Block& other, void* memory = nullptr);
+	static void dispose(const Block* block) noexcept;
+
+	Block* getNext() const noexcept;
+	Block* getPrevious() const noexcept;
+	Block* getNextDeleting() const noexcept;
+	Block* getPreviousDeleting() const noexcept;
+	Element< T >* getElements() const noexcept;
+	Element< T >& getElement(size_type index) const noexcept;
+	T& getValue(size_type index) const noexcept;
+	T* getValues() const noexcept;
+	[[nodiscard]] size_type getBlockCapacity() const noexcept;
+	[[nodiscard]] size_type getSize() const noexcept;
+	[[nodiscard]] size_type getUsed() const noexcept;
+	[[nodiscard]] size_type getFirst() const noexcept;
+	[[nodiscard]] size_type getLast() const noexcept;
+	[[nodiscard]] size_type getDeletedCount() const noexcept;
+	[[nodiscard]] bool hasUnusedCells() const noexcept;
+	[[nodiscard]] std::uint32_t getId() const noexcept;
+	[[nodiscard]] std::uint32_t getDeletingBucket() const noexcept;
+	[[nodiscard]] bool isEmbedded() const noexcept;
+	[[nodiscard]] time_point getOldest() const noexcept;
+	[[nodiscard]] time_point getNewest() const noexcept;
+
+	void setNext(Block* new_next) noexcept;
+	void setPrevious(Block* new_previous) noexcept;
+	void setNextDeleting(Block* new_next) noexcept;
+	void setPreviousDeleting(Block* new_previous) noexcept;
+	void setId(std::uint32_t new_id) noexcept;
+	void setDeletingBucket(std::uint32_t new_bucket) noexcept;
+	void setTimes(time_point oldest, time_point newest) noexcept;
+	void stamp(time_point oldest, time_point newest) noexcept;
+
+	template< typename... Args >
+	size_type emplace(Args&&... args);
+	void destroy(size_type index) noexcept;
+	void reset() noexcept;
+	void restoreCell(bool is_active) noexcept;
+
+	void retain() const noexcept;
+	[[nodiscard]] bool release() const noexcept;
+	[[nodiscard]] bool isShared() const noexcept;
 };
 
 template< typename T >
-void Element< T >::swap(Element& other) noexcept
+constexpr typename Block< T >::size_type Block< T >::alignUp(size_type offset, size_type align) noexcept
 {
-	std::swap(value_, other.value_);
-	std::swap(index_, other.index_);
-	std::swap(next_, other.next_);
-	std::swap(previous_, other.previous_);
+	return (offset + align - 1) / align * align;
 }
 
 template< typename T >
-void Element< T >::clear() noexcept
+constexpr typename Block< T >::size_type Block< T >::valuesOffset() noexcept
 {
-	if (is_active_)
-		delete value_;
-	value_ = nullptr;
-	next_ = nullptr;
-	previous_ = nullptr;
+	return alignUp(sizeof(Block), alignof(T));
 }
 
 template< typename T >
-bool Element< T >::isActive() const noexcept
+constexpr typename Block< T >::size_type Block< T >::elementsOffset(size_type block_capacity) noexcept
 {
-	return is_active_;
+	return alignUp(valuesOffset() + block_capacity * sizeof(T), alignof(element_type));
 }
 
 template< typename T >
-std::size_t Element< T >::getIndex() const noexcept
+constexpr typename Block< T >::size_type Block< T >::allocationSize(size_type block_capacity) noexcept
 {
-	return index_;
+	return elementsOffset(block_capacity) + block_capacity * sizeof(element_type);
 }
 
 template< typename T >
-T* Element< T >::getValue() const noexcept
+constexpr typename Block< T >::size_type Block< T >::fittingCapacity(size_type target_bytes, size_type min_capacity) noexcept
 {
-	return value_;
-}
+	size_type capacity = 1;
+	while (allocationSize(capacity * 2) <= target_bytes)
+		capacity *= 2;
 
-template< typename T >
-Element< T >* Element< T >::getNext() const noexcept
-{
-	return next_;
+	return std::max(capacity, min_capacity);
 }
 
 template< typename T >
-Element< T >* Element< T >::getPrevious() const noexcept
+void* Block< T >::allocate(size_type block_capacity)
 {
-	return previous_;
+	if constexpr (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+		return ::operator new(allocationSize(block_capacity), std::align_val_t(alignment));
+	else
+		return ::operator new(allocationSize(block_capacity));
 }
 
 template< typename T >
-void Element< T >::setIsActive(bool is_active) noexcept
+void Block< T >::deallocate(void* memory) noexcept
 {
-	is_active_ = is_active;
+	if constexpr (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+		::operator delete(memory, std::align_val_t(alignment));
+	else
+		::operator delete(memory);
 }
 
 template< typename T >
-void Element< T >::setIndex(std::size_t new_index) noexcept
+Block< T >::Block(size_type block_capacity) noexcept : block_capacity_(block_capacity)
 {
-	index_ = new_index;
+	auto* memory = reinterpret_cast< unsigned char* >(this);
+	values_ = reinterpret_cast< T* >(memory + valuesOffset());
+	elements_ = ::new (static_cast< void* >(memory + elementsOffset(block_capacity_))) element_type[block_capacity_];
 }
 
+// Copies the slot layout only; clone() constructs the values.
 template< typename T >
-void Element< T >::setValue(T* value) noexcept
+Block< T >::Block(const Block& other) noexcept : Block(other.block_capacity_)
 {
-	value_ = value;
+	size_ = other.size_;
+	used_ = other.used_;
+	first_ = other.first_;
+	last_ = other.last_;
+	deleted_cells_ = other.deleted_cells_;
+	deleted_count_ = other.deleted_count_;
+	oldest_ = other.oldest_;
+	newest_ = other.newest_;
+	id_ = other.id_;
+	deleting_bucket_ = other.deleting_bucket_;
+	std::copy(other.elements_, other.elements_ + used_, elements_);
 }
 
+// Trivially destructible values are left as they are, so freeing such a
+// block does not touch its slots.
 template< typename T >
-void Element< T >::setNext(Element* next) noexcept
+Block< T >::~Block()
 {
-	next_ = next;
+	if constexpr (!std::is_trivially_destructible_v< T >)
+		for (size_type index = first_; index != npos; index = elements_[index].getNext())
+			values_[index].~T();
 }
 
 template< typename T >
-void Element< T >::setPrevious(Element* previous) noexcept
+Block< T >* Block< T >::create(size_type block_capacity, void* memory)
 {
-	previous_ = previous;
+	auto* block = ::new (memory ? memory : allocate(block_capacity)) Block(block_capacity);
+	block->embedded_ = memory != nullptr;
+	return block;
 }
 
 template< typename T >
-Element< T >::Element(Element&& other) noexcept :
-	value_(other.value_), index_(other.index_), next_(other.next_), previous_(other.previous_)
+Block< T >* Block< T >::clone(const Block& other, void* memory)
 {
-	other.value_ = nullptr;
-	other.next_ = nullptr;
-	other.previous_ = nullptr;
-}
+	auto* block = ::new (memory ? memory : allocate(other.block_capacity_)) Block(other);
+	block->embedded_ = memory != nullptr;
 
-template< typename T >
-Element< T >& Element< T >::operator=(Element&& other) noexcept
-{
-	if (this != &other)
+	// Holes are copied along, their bytes are never read as values.
+	if constexpr (std::is_trivially_copyable_v< T >)
 	{
-		clear();
-		swap(other);
+		std::memcpy(static_cast< void* >(block->values_), static_cast< const void* >(other.values_), block->used_ * sizeof(T));
+		return block;
 	}
-	return *this;
+
+	size_type index = block->first_;
+	try
+	{
+		for (; index != npos; index = block->elements_[index].getNext())
+			::new (static_cast< void* >(block->values_ + index)) T(other.values_[index]);
+	} catch (...)
+	{
+		for (size_type i = block->first_; i != index; i = block->elements_[i].getNext())
+			block->values_[i].~T();
+		if (!memory)
+			deallocate(block);
+		throw;
+	}
+
+	return block;
 }
 
+// Moves the values of other into a new block, embedded at memory if given;
+// other keeps its moved-from values until it is disposed of. Only the
+// allocation of a heap block can throw.
 template< typename T >
-Element< T >::Element(const Element& other) :
-	index_(other.index_), next_(other.next_), value_(new T(*other.value_)), previous_(other.previous_)
+Block< T >* Block< T >::relocate(Block& other, void* memory)
 {
+	static_assert(std::is_nothrow_move_constructible_v< T >, "Embedded blocks need a nothrow move constructible value_type.");
+	auto* block = ::new (memory ? memory : allocate(other.block_capacity_)) Block(other);
+	block->embedded_ = memory != nullptr;
+
+	if constexpr (std::is_trivially_copyable_v< T >)
+		std::memcpy(static_cast< void* >(block->values_), static_cast< const void* >(other.values_), block->used_ * sizeof(T));
+	else
+		for (size_type index = block->first_; index != npos; index = block->elements_[index].getNext())
+			::new (static_cast< void* >(block->values_ + index)) T(std::move(other.values_[index]));
+
+	return block;
 }
 
 template< typename T >
-Element< T >& Element< T >::operator=(const Element& other)
+void Block< T >::dispose(const Block* block) noexcept
 {
-	if (this != &other && other.is_active_)
-	{
-		Element< T > copy(other);
-		swap(copy);
-	}
-	return *this;
+	auto* mutable_block = const_cast< Block* >(block);
+	const bool embedded = mutable_block->embedded_;
+	mutable_block->~Block();
+	if (!embedded)
+		deallocate(mutable_block);
 }
 
 template< typename T >
-struct DeletedCell
+void Block< T >::link(size_type index) noexcept
 {
-  private:
-	using element_type = Element< T >*;
-	element_type left_{ nullptr };
-	element_type position_{ nullptr };
-	element_type right_{ nullptr };
+	elements_[index].setIsActive(true);
+	elements_[index].setNext(npos);
+	elements_[index].setPrevious(last_);
 
-  public:
-	explicit DeletedCell(element_type left_, element_type position_, element_type right_);
-	DeletedCell(DeletedCell&& other) noexcept;
-	DeletedCell& operator=(DeletedCell&& other) noexcept;
-	DeletedCell(const DeletedCell& other);
-	DeletedCell& operator=(const DeletedCell& other);
+	if (last_ != npos)
+		elements_[last_].setNext(index);
+	else
+		first_ = index;
 
-	void swap(DeletedCell& other) noexcept;
+	last_ = index;
+	++size_;
+}
 
-	element_type getLeft() const noexcept;
-	element_type getPosition() const noexcept;
-	element_type getRight() const noexcept;
+template< typename T >
+void Block< T >::unlink(size_type index) noexcept
+{
+	element_type& element = elements_[index];
 
-	void setLeft(element_type new_left) noexcept;
-	void setPosition(element_type new_position) noexcept;
-	void setRight(element_type new_right) noexcept;
-};
+	if (element.getPrevious() != npos)
+		elements_[element.getPrevious()].setNext(element.getNext());
+	else
+		first_ = element.getNext();
+
+	if (element.getNext() != npos)
+		elements_[element.getNext()].setPrevious(element.getPrevious());
+	else
+		last_ = element.getPrevious();
+
+	element.setIsActive(false);
+	element.nextGeneration();
+	element.setPrevious(npos);
+	element.setNext(deleted_cells_);
+	deleted_cells_ = index;
+	++deleted_count_;
+	--size_;
+}
 
 template< typename T >
-void DeletedCell< T >::swap(DeletedCell& other) noexcept
+template< typename... Args >
+typename Block< T >::size_type Block< T >::emplace(Args&&... args)
 {
-	std::swap(left_, other.left_);
-	std::swap(right_, other.right_);
-	std::swap(position_, other.position_);
+	const bool reuse = deleted_cells_ != npos;
+	const size_type index = reuse ? deleted_cells_ : used_;
+
+	::new (static_cast< void* >(values_ + index)) T(std::forward< Args >(args)...);
+
+	if (reuse)
+	{
+		deleted_cells_ = elements_[index].getNext();
+		--deleted_count_;
+	}
+	else
+		++used_;
+
+	link(index);
+	return index;
 }
 
 template< typename T >
-DeletedCell< T >::DeletedCell(element_type left_, element_type position_, element_type right_) :
-	left_(left_), position_(position_), right_(right_)
+void Block< T >::destroy(size_type index) noexcept
 {
+	values_[index].~T();
+	unlink(index);
 }
 
 template< typename T >
-DeletedCell< T >::DeletedCell(DeletedCell&& other) noexcept :
-	left_(other.left_), position_(other.position_), right_(other.right_)
+void Block< T >::reset() noexcept
 {
-	other.left_ = nullptr;
-	other.position_ = nullptr;
-	other.right_ = nullptr;
+	if constexpr (!std::is_trivially_destructible_v< T >)
+		for (size_type index = first_; index != npos; index = elements_[index].getNext())
+			values_[index].~T();
+
+	size_ = 0;
+	used_ = 0;
+	first_ = npos;
+	last_ = npos;
+	deleted_cells_ = npos;
+	deleted_count_ = 0;
 }
 
+// Appends the next unused slot while rebuilding a block from a dump; an
+// active slot must already hold a constructed value.
 template< typename T >
-DeletedCell< T >& DeletedCell< T >::operator=(DeletedCell&& other) noexcept
+void Block< T >::restoreCell(bool is_active) noexcept
 {
-	if (this != &other)
+	const size_type index = used_++;
+
+	if (is_active)
 	{
-		swap(other);
+		link(index);
+		return;
 	}
-	return *this;
+
+	elements_[index].setNext(deleted_cells_);
+	deleted_cells_ = index;
+	++deleted_count_;
 }
 
 template< typename T >
-DeletedCell< T >::DeletedCell(const DeletedCell& other) :
-	left_(other.left_), position_(other.position_), right_(other.right_)
+void Block< T >::retain() const noexcept
 {
+	references_.fetch_add(1, std::memory_order_relaxed);
 }
 
 template< typename T >
-DeletedCell< T >& DeletedCell< T >::operator=(const DeletedCell& other)
+bool Block< T >::release() const noexcept
 {
-	if (this != &other)
-	{
-		DeletedCell< T > copy(other);
-		swap(copy);
-	}
-	return *this;
+	return references_.fetch_sub(1, std::memory_order_acq_rel) == 1;
 }
 
 template< typename T >
-typename DeletedCell< T >::element_type DeletedCell< T >::getLeft() const noexcept
+bool Block< T >::isShared() const noexcept
 {
-	return left_;
+	return references_.load(std::memory_order_acquire) > 1;
 }
 
 template< typename T >
-typename DeletedCell< T >::element_type DeletedCell< T >::getPosition() const noexcept
+Block< T >* Block< T >::getNext() const noexcept
 {
-	return position_;
+	return next_;
 }
 
 template< typename T >
-typename DeletedCell< T >::element_type DeletedCell< T >::getRight() const noexcept
+Block< T >* Block< T >::getPrevious() const noexcept
 {
-	return right_;
+	return previous_;
 }
 
 template< typename T >
-void DeletedCell< T >::setLeft(element_type new_left) noexcept
+Block< T >* Block< T >::getNextDeleting() const noexcept
 {
-	left_ = new_left;
+	return next_deleting_;
 }
 
 template< typename T >
-void DeletedCell< T >::setPosition(element_type new_position) noexcept
+Block< T >* Block< T >::getPreviousDeleting() const noexcept
 {
-	position_ = new_position;
+	return previous_deleting_;
 }
 
 template< typename T >
-void DeletedCell< T >::setRight(element_type new_right) noexcept
+Element< T >* Block< T >::getElements() const noexcept
 {
-	right_ = new_right;
+	return elements_;
 }
 
 template< typename T >
-struct Block
+Element< T >& Block< T >::getElement(size_type index) const noexcept
 {
-  private:
-	using size_type = std::size_t;
-	Block* next_{ nullptr };
-	Block* previous_{ nullptr };
-	Element< T >* elements_{ nullptr };
-	Stack< DeletedCell< T > > deleted_cells_{};
-	size_type block_capacity_{ 0 };
+	return elements_[index];
+}
 
-  public:
-	explicit Block() = default;
-	~Block();
-	Block(Block&& other) noexcept;
-	Block& operator=(Block&& other) noexcept;
-	Block(const Block& other);
-	Block& operator=(const Block& other);
-	void swap(Block& other) noexcept;
+template< typename T >
+T& Block< T >::getValue(size_type index) const noexcept
+{
+	return values_[index];
+}
 
-	Block* getNext() const noexcept;
-	Block* getPrevious() const noexcept;
-	Element< T >* getElements() const noexcept;
-	Element< T >& getElement(size_type index) const noexcept;
-	Stack< DeletedCell< T > >& getDeletedCells() noexcept;
-	[[nodiscard]] size_type getBlockCapacity() const noexcept;
+template< typename T >
+T* Block< T >::getValues() const noexcept
+{
+	return values_;
+}
 
-	void setNext(Block* new_next) noexcept;
-	void setPrevious(Block* new_previous) noexcept;
-	void setElements(Element< T >* new_elements) noexcept;
-	void setBlockCapacity(size_type new_capacity) noexcept;
-	void setDeletedCell(Stack< DeletedCell< T > > new_deleted_cell) noexcept;
-};
+template< typename T >
+typename Block< T >::size_type Block< T >::getBlockCapacity() const noexcept
+{
+	return block_capacity_;
+}
 
 template< typename T >
-void Block< T >::swap(Block& other) noexcept
+typename Block< T >::size_type Block< T >::getSize() const noexcept
 {
-	std::swap(next_, other.next_);
-	std::swap(previous_, other.previous_);
-	std::swap(elements_, other.elements_);
-	std::swap(deleted_cells_, other.deleted_cells_);
+	return size_;
 }
 
 template< typename T >
-Block< T >::~Block()
+typename Block< T >::size_type Block< T >::getUsed() const noexcept
 {
-	elements_[0].clear();
-	auto* element = &elements_[1];
+	return used_;
+}
 
-	while (element && element->getIndex() != 0)
-	{
-		auto next_element = element->getNext();
-		element->clear();
-		element = next_element;
-	}
-	previous_ = nullptr;
-	next_ = nullptr;
+template< typename T >
+typename Block< T >::size_type Block< T >::getFirst() const noexcept
+{
+	return first_;
 }
 
 template< typename T >
-Block< T >::Block(Block&& other) noexcept :
-	next_(other.next_), previous_(other.previous_), elements_(other.elements_),
-	deleted_cells_(std::move(other.deleted_cells_)), block_capacity_(other.block_capacity_)
+typename Block< T >::size_type Block< T >::getLast() const noexcept
 {
-	other.next_ = nullptr;
-	other.previous_ = nullptr;
-	other.elements_ = nullptr;
+	return last_;
 }
 
 template< typename T >
-Block< T >& Block< T >::operator=(Block&& other) noexcept
+typename Block< T >::size_type Block< T >::getDeletedCount() const noexcept
 {
-	if (this != &other)
-		swap(other);
+	return deleted_count_;
+}
 
-	return *this;
+template< typename T >
+bool Block< T >::hasUnusedCells() const noexcept
+{
+	return used_ < block_capacity_;
 }
 
 template< typename T >
-Block< T >::Block(const Block& other) :
-	next_(other.next_), previous_(other.previous_), deleted_cells_(other.deleted_cells_)
+std::uint32_t Block< T >::getId() const noexcept
 {
-	elements_ = new Element< T >[other.block_capacity_];
-	for (size_type i = 0; i < other.block_capacity_; ++i)
-	{
-		elements_[i] = other.elements_[i];
-	}
+	return id_;
 }
 
 template< typename T >
-Block< T >& Block< T >::operator=(const Block& other)
+void Block< T >::setNext(Block* new_next) noexcept
 {
-	if (this != &other)
-	{
-		Block< T > copy(other);
-		swap(copy);
-	}
-	return *this;
+	next_ = new_next;
 }
 
 template< typename T >
-Block< T >* Block< T >::getNext() const noexcept
+void Block< T >::setPrevious(Block* new_previous) noexcept
 {
-	return next_;
+	previous_ = new_previous;
 }
 
 template< typename T >
-Block< T >* Block< T >::getPrevious() const noexcept
+void Block< T >::setNextDeleting(Block* new_next) noexcept
 {
-	return previous_;
+	next_deleting_ = new_next;
 }
 
 template< typename T >
-Element< T >* Block< T >::getElements() const noexcept
+void Block< T >::setPreviousDeleting(Block* new_previous) noexcept
 {
-	return elements_;
+	previous_deleting_ = new_previous;
 }
 
 template< typename T >
-Element< T >& Block< T >::getElement(size_type index) const noexcept
+void Block< T >::setId(std::uint32_t new_id) noexcept
 {
-	return elements_[index];
+	id_ = new_id;
 }
 
 template< typename T >
-Stack< DeletedCell< T > >& Block< T >::getDeletedCells() noexcept
+std::uint32_t Block< T >::getDeletingBucket() const noexcept
 {
-	return deleted_cells_;
+	return deleting_bucket_;
 }
 
 template< typename T >
-typename Block< T >::size_type Block< T >::getBlockCapacity() const noexcept
+bool Block< T >::isEmbedded() const noexcept
 {
-	return block_capacity_;
+	return embedded_;
 }
 
 template< typename T >
-void Block< T >::setNext(Block* new_next) noexcept
+typename Block< T >::time_point Block< T >::getOldest() const noexcept
 {
-	next_ = new_next;
+	return oldest_;
 }
 
 template< typename T >
-void Block< T >::setPrevious(Block* new_previous) noexcept
+typename Block< T >::time_point Block< T >::getNewest() const noexcept
 {
-	previous_ = new_previous;
+	return newest_;
 }
 
 template< typename T >
-void Block< T >::setElements(Element< T >* new_elements) noexcept
+void Block< T >::setDeletingBucket(std::uint32_t new_bucket) noexcept
 {
-	elements_ = new_elements;
+	deleting_bucket_ = new_bucket;
 }
 
 template< typename T >
-void Block< T >::setBlockCapacity(size_type new_capacity) noexcept
+void Block< T >::setTimes(time_point oldest, time_point newest) noexcept
 {
-	block_capacity_ = new_capacity;
+	oldest_ = oldest;
+	newest_ = newest;
 }
 
+// Widens the time range by elements just added, inserted between oldest
+// and newest; the first element of an empty block starts a new range.
 template< typename T >
-void Block< T >::setDeletedCell(Stack< DeletedCell< T > > new_deleted_cell) noexcept
+void Block< T >::stamp(time_point oldest, time_point newest) noexcept
 {
-	deleted_cells_ = new_deleted_cell;
+	if (size_ == 1)
+		setTimes(oldest, newest);
+	else
+		setTimes(std::min(oldest_, oldest), std::max(newest_, newest));
 }
 
 template< bool Flag, typename U, typename V >
 using conditional_t = typename std::conditional< Flag, U, V >::type;
 
-template< typename T >
+// Default (de)serializer of BucketStorage::save/load: block payloads are
+// written and read back with a single memcpy, so the value_type has to be
+// trivially copyable. Other types pass a callable instead:
+//   save: void(std::ostream&, const T&)    load: T(std::istream&)
+struct RawSerializer
+{
+};
+
+// Which erased slot insert() fills. Lifo takes the block erased from most
+// recently; FullestBlockFirst takes a block with the fewest free slots
+// (bucketed by powers of two), so sparse blocks drain and get released.
+enum class ReusePolicy
+{
+	Lifo,
+	FullestBlockFirst
+};
+
+// Hot-path events reported to the Instrumentation policy of BucketStorage.
+// BlockHop is an iterator step that crosses into another block, Iterate an
+// iterator stepping past the last element. Relocate is only traced: it is
+// an element moved to another slot by compact_step. Evict is one block
+// dropped by a bounded storage, see set_bounds().
+enum class StorageEvent : std::size_t
+{
+	Insert,
+	InsertInDeletedCell,
+	Erase,
+	AddBlock,
+	DelBlock,
+	BlockHop,
+	Iterate,
+	Clear,
+	ShrinkToFit,
+	Compact,
+	Relocate,
+	Evict
+};
+
+inline constexpr std::size_t storage_event_count = 12;
+
+// Default policy: every hook compiles away. An enabled policy declares
+// `static constexpr bool enabled = true` and
+//   void record(StorageEvent event, std::chrono::nanoseconds elapsed);
+// which the storage calls once per event with its wall time (zero for
+// BlockHop and Iterate). Nested events (AddBlock inside Insert) are
+// reported first. A policy that also declares
+//   void trace(StorageEvent event, std::uint64_t location, std::uint64_t previous);
+// gets the slot (block id << 32 | slot) of every inserted, erased and
+// relocated element; previous is the old slot of a relocated one.
+// shrink_to_fit traces its moves as ShrinkToFit: their slots belong to the
+// rebuilt storage, which replaces the old one when the step is recorded.
+struct NoInstrumentation
+{
+	static constexpr bool enabled = false;
+};
+
+// Counts events and sums their wall time. Derive from it and shadow
+// record() to forward events to tracing markers or histograms as well.
+class CountingInstrumentation
+{
+  private:
+	std::array< std::size_t, storage_event_count > counts_{};
+	std::array< std::chrono::nanoseconds, storage_event_count > times_{};
+
+  public:
+	static constexpr bool enabled = true;
+
+	void record(StorageEvent event, std::chrono::nanoseconds elapsed) noexcept;
+	std::size_t getCount(StorageEvent event) const noexcept;
+	std::chrono::nanoseconds getTime(StorageEvent event) const noexcept;
+	void reset() noexcept;
+};
+
+inline void CountingInstrumentation::record(StorageEvent event, std::chrono::nanoseconds elapsed) noexcept
+{
+	++counts_[static_cast< std::size_t >(event)];
+	times_[static_cast< std::size_t >(event)] += elapsed;
+}
+
+inline std::size_t CountingInstrumentation::getCount(StorageEvent event) const noexcept
+{
+	return counts_[static_cast< std::size_t >(event)];
+}
+
+inline std::chrono::nanoseconds CountingInstrumentation::getTime(StorageEvent event) const noexcept
+{
+	return times_[static_cast< std::size_t >(event)];
+}
+
+inline void CountingInstrumentation::reset() noexcept
+{
+	counts_.fill(0);
+	times_.fill(std::chrono::nanoseconds::zero());
+}
+
+// Times the enclosing scope and reports it as one event; an empty object
+// for disabled policies.
+template< typename Instrumentation, bool Enabled = Instrumentation::enabled >
+class EventScope
+{
+  public:
+	EventScope(Instrumentation&, StorageEvent) noexcept {}
+};
+
+template< typename Instrumentation >
+class EventScope< Instrumentation, true >
+{
+  private:
+	Instrumentation& instrumentation_;
+	StorageEvent event_;
+	std::chrono::steady_clock::time_point start_;
+
+  public:
+	EventScope(Instrumentation& instrumentation, StorageEvent event) noexcept;
+	EventScope(const EventScope&) = delete;
+	EventScope& operator=(const EventScope&) = delete;
+	~EventScope();
+};
+
+template< typename Instrumentation >
+EventScope< Instrumentation, true >::EventScope(Instrumentation& instrumentation, StorageEvent event) noexcept :
+	instrumentation_(instrumentation), event_(event), start_(std::chrono::steady_clock::now())
+{
+}
+
+template< typename Instrumentation >
+EventScope< Instrumentation, true >::~EventScope()
+{
+	instrumentation_.record(event_, std::chrono::duration_cast< std::chrono::nanoseconds >(std::chrono::steady_clock::now() - start_));
+}
+
+template< typename T, typename Instrumentation = NoInstrumentation >
 class BucketStorage
 {
   public:
@@ -554,13 +820,17 @@ class BucketStorage
 	class Iterator
 	{
 	  private:
-		using element_type_ = Element< T >;
-		using end_pointer_type = conditional_t< IsConst, element_type_ const * const *, element_type_** >;
+		template< bool >
+		friend class Iterator;
 
-		element_type_* current_node_{ nullptr };
-		end_pointer_type end_{ nullptr };
-		Block< T >* current_block_;
-		size_type block_capacity_;
+		using storage_pointer = conditional_t< IsConst, const BucketStorage*, BucketStorage* >;
+
+		// The block is kept by id and looked up in owner_ on each access, so
+		// every iterator follows a block that copy-on-write replaced. Moving
+		// or swapping the storage invalidates its iterators.
+		storage_pointer owner_{ nullptr };
+		std::uint32_t current_block_{ no_block };
+		size_type current_index_{ 0 };
 		size_type current_position_{ 0 };
 
 	  public:
@@ -570,11 +840,13 @@ class BucketStorage
 		using reference = conditional_t< IsConst, const value_type&, value_type& >;
 		using iterator_category = std::bidirectional_iterator_tag;
 
-		explicit Iterator(element_type_* current_node, end_pointer_type end, Block< T >* current_block, size_type block_capacity);
-		explicit Iterator(element_type_* current_node, end_pointer_type end, Block< T >* current_block, size_type block_capacity, size_type current_position);
+		explicit Iterator(storage_pointer owner, Block< T >* current_block, size_type current_index);
+		explicit Iterator(storage_pointer owner, Block< T >* current_block, size_type current_index, size_type current_position);
 		Iterator(const Iterator& other);
+		template< bool OtherIsConst, typename = std::enable_if_t< IsConst && !OtherIsConst > >
+		Iterator(const Iterator< OtherIsConst >& other);
+		Iterator& operator=(const Iterator& other) = default;
 
-		element_type_* getCurrent() const;
 		bool operator==(const Iterator& other) const;
 		bool operator!=(const Iterator& other) const;
 
@@ -597,8 +869,9 @@ class BucketStorage
 		reference operator*() const;
 		pointer operator->() const;
 
-		Block< T >* getCurrentBlock();
-		element_type_* getCurrentElement();
+		Block< T >* getCurrentBlock() const;
+		size_type getCurrentIndex() const;
+		size_type getCurrentPosition() const;
 	};
 
 	template< bool IsConst >
@@ -609,25 +882,250 @@ class BucketStorage
 
 	using difference_type = typename iterator::difference_type;
 
-  private:
-	using element_type = Element< T >;
-	using block_type = Block< T >;
-	Stack< block_type* > last_deleting_;
-	block_type* head_block_{ nullptr };
-	block_type* tail_block_{ nullptr };
-	element_type* last_object_{ nullptr };
-	element_type* first_element_{ nullptr };
-	size_type size_{ 0 };
-	size_type block_capacity_{ 0 };
-	size_type current_index_{ 0 };
+	// Stable reference to an element: block id, slot and the slot generation.
+	// Block ids are recycled with a new epoch and a slot's generation changes
+	// on every erase, so get() on a handle to an erased element returns null
+	// even after the slot or the block has been reused.
+	class Handle
+	{
+	  private:
+		friend class BucketStorage;
+
+		std::uint32_t block_{ 0 };
+		std::uint32_t epoch_{ 0 };
+		std::uint32_t slot_{ 0 };
+		std::uint32_t generation_{ 0 };
+
+		constexpr Handle(std::uint32_t block, std::uint32_t epoch, std::uint32_t slot, std::uint32_t generation) noexcept;
+
+	  public:
+		constexpr Handle() noexcept = default;
+
+		[[nodiscard]] constexpr std::uint32_t getBlock() const noexcept;
+		[[nodiscard]] constexpr std::uint32_t getEpoch() const noexcept;
+		[[nodiscard]] constexpr std::uint32_t getSlot() const noexcept;
+		[[nodiscard]] constexpr std::uint32_t getGeneration() const noexcept;
+
+		constexpr bool operator==(const Handle& other) const noexcept;
+		constexpr bool operator!=(const Handle& other) const noexcept;
+	};
+
+	// Immutable view of the storage at the moment snapshot() was called. It
+	// shares blocks with the storage; the storage copies a block the first
+	// time it mutates it or hands out a mutable reference into it while a
+	// snapshot still references it. A snapshot may be read and destroyed on
+	// any thread.
+	class Snapshot
+	{
+	  public:
+		class ConstIterator
+		{
+		  private:
+			const std::vector< const Block< T >* >* blocks_{ nullptr };
+			size_type current_block_{ 0 };
+			size_type current_index_{ 0 };
+
+		  public:
+			using difference_type = std::ptrdiff_t;
+			using value_type = T;
+			using pointer = const value_type*;
+			using reference = const value_type&;
+			using iterator_category = std::forward_iterator_tag;
+
+			explicit ConstIterator(const std::vector< const Block< T >* >* blocks, size_type current_block);
+
+			bool operator==(const ConstIterator& other) const;
+			bool operator!=(const ConstIterator& other) const;
+
+			ConstIterator& operator++();
+			ConstIterator operator++(int);
+
+			reference operator*() const;
+			pointer operator->() const;
+		};
+
+		using const_iterator = ConstIterator;
+
+		Snapshot() = default;
+		Snapshot(const Snapshot& other);
+		Snapshot(Snapshot&& other) noexcept;
+		Snapshot& operator=(const Snapshot& other);
+		Snapshot& operator=(Snapshot&& other) noexcept;
+		~Snapshot();
+
+		const_iterator begin() const noexcept;
+		const_iterator end() const noexcept;
+
+		[[nodiscard]] size_type size() const noexcept;
+		[[nodiscard]] bool empty() const noexcept;
+		void swap(Snapshot& other) noexcept;
+
+		template< typename Serializer = RawSerializer >
+		void save(std::ostream& out, Serializer serializer = Serializer()) const;
+		template< typename Serializer = RawSerializer >
+		void save(const std::string& path, Serializer serializer = Serializer()) const;
+
+	  private:
+		friend class BucketStorage;
+
+		std::vector< const Block< T >* > blocks_;
+		size_type size_{ 0 };
+		size_type min_block_capacity_{ 0 };
+		size_type max_block_capacity_{ 0 };
+
+		explicit Snapshot(std::vector< const Block< T >* > blocks, size_type size, size_type min_block_capacity, size_type max_block_capacity) noexcept;
+		void release() noexcept;
+	};
+
+	// Per-block occupancy reported by stats(): live elements and erased
+	// holes waiting for reuse, out of capacity slots.
+	struct BlockStats
+	{
+		size_type capacity{ 0 };
+		size_type live{ 0 };
+		size_type erased{ 0 };
+	};
+
+	// Point-in-time view of the storage layout, O(blocks) to collect.
+	// fragmentation is the share of touched slots (live + erased) that are
+	// holes; deleting_blocks counts blocks on the reuse list. The allocation
+	// counters cover the whole lifetime of the storage, so
+	// block_allocations - block_frees == block_count. block_bytes is what
+	// the byte limit of set_bounds() applies to.
+	struct Stats
+	{
+		size_type block_count{ 0 };
+		size_type size{ 0 };
+		std::vector< BlockStats > blocks;
+		double fragmentation{ 0.0 };
+		size_type deleting_blocks{ 0 };
+		size_type metadata_bytes{ 0 };
+		size_type payload_bytes{ 0 };
+		size_type block_allocations{ 0 };
+		size_type block_frees{ 0 };
+		size_type block_bytes{ 0 };
+	};
+
+	// Called for each element of a block evicted by a bounded storage, before
+	// the element is destroyed.
+	using evict_callback = std::function< void(const Handle&, const value_type&) >;
+	using time_point = std::chrono::steady_clock::time_point;
+
+  private:
+	using element_type = Element< T >;
+	using block_type = Block< T >;
+	static constexpr size_type npos = element_type::npos;
+	static constexpr std::uint32_t no_block = static_cast< std::uint32_t >(-1);
+	static constexpr std::uint32_t dump_magic = 0x5453424B;
+	static constexpr std::uint32_t dump_version = 2;
+
+	struct BlockSlot
+	{
+		block_type* block{ nullptr };
+		std::uint32_t epoch{ 0 };
+		std::uint32_t next_free{ no_block };
+	};
+
+	std::vector< BlockSlot > blocks_;
+	std::uint32_t free_block_id_{ no_block };
+	// Blocks with erased slots, on intrusive lists bucketed by
+	// deletingBucket(); bit i of deleting_mask_ is set while bucket i is not
+	// empty, so the lowest set bit is the next block to reuse.
+	static constexpr std::uint32_t deleting_buckets = 32;
+	std::array< block_type*, deleting_buckets > deleting_{};
+	std::uint32_t deleting_mask_{ 0 };
+	ReusePolicy reuse_policy_{ ReusePolicy::Lifo };
+	block_type* head_block_{ nullptr };
+	block_type* tail_block_{ nullptr };
+	// Set by clear_keep_capacity(): appends go here, then through the kept
+	// blocks behind it, instead of to the tail. Null otherwise.
+	block_type* fill_block_{ nullptr };
+	size_type size_{ 0 };
+	size_type min_block_capacity_{ 0 };
+	size_type max_block_capacity_{ 0 };
+	size_type capacity_{ 0 };
+	size_type block_count_{ 0 };
+	size_type block_allocations_{ 0 };
+	size_type block_frees_{ 0 };
+	// Bytes of every block allocation, embedded block included.
+	size_type block_bytes_{ 0 };
+	// Limits from set_bounds(), 0 for none.
+	size_type max_size_{ 0 };
+	size_type max_bytes_{ 0 };
+	evict_callback on_evict_;
+	// Belongs to the storage object rather than its contents: copied and
+	// moved on construction, but never swapped or assigned.
+	[[no_unique_address]] mutable Instrumentation instrumentation_;
+	// Inserts are only stamped once expiry is enabled, from the manual clock
+	// of set_insert_time() or, while that is empty, steady_clock. Both belong
+	// to the object, like instrumentation_.
+	bool expiry_{ false };
+	std::optional< time_point > insert_time_;
+
+	// Room for the first block when BlockSizeTraits asks for one. While that
+	// block is alive it is the head: blocks are only ever appended.
+	static constexpr size_type inline_capacity = inlineBlockCapacity< T >();
+	struct InlineBlock
+	{
+		alignas(block_type::alignment) unsigned char bytes[block_type::allocationSize(inline_capacity)];
+	};
+	struct NoInlineBlock
+	{
+	};
+	[[no_unique_address]] std::conditional_t< inline_capacity != 0, InlineBlock, NoInlineBlock > inline_;
 
+	void abandon() noexcept;
 	void addBlock();
+	void* inlineMemory() noexcept;
+	block_type* relocateBlock(block_type* block, void* memory);
+	size_type nextBlockCapacity() const noexcept;
+	void linkBlock(block_type* block);
+	void cloneBlocks(const BucketStorage& other);
 	void delBlock(block_type* block);
-	element_type* insertInDeletedCellBody();
-	iterator insertInDeletedCell(const value_type& value);
-	iterator insertInDeletedCell(value_type&& value);
-	void insertBody();
-	void initializationContainer();
+	void dropBlock(block_type* block) noexcept;
+	void unlinkBlock(block_type* block) noexcept;
+	void appendBlock(block_type* block);
+	void handOver(block_type* block, BucketStorage& to);
+	void reserveBlockId();
+	void evictBlock(block_type* block);
+	void evictForSize();
+	void evictForBytes();
+	bool evictionDue() const noexcept;
+	time_point stampTime() const noexcept;
+	void startExpiry(time_point now) noexcept;
+	void eraseAt(block_type* block, size_type index);
+	block_type* detachBlock(block_type* block);
+	void replaceBlock(block_type* block, block_type* copy) noexcept;
+	void pushDeleting(block_type* block) noexcept;
+	void popDeleting(block_type* block) noexcept;
+	std::uint32_t deletingBucket(const block_type* block) const noexcept;
+	block_type* reuseBlock() const noexcept;
+	void registerBlock(block_type* block);
+	void unregisterBlock(const block_type* block) noexcept;
+	block_type* findBlock(const Handle& handle) const noexcept;
+	Handle makeHandle(const block_type* block, size_type slot) const noexcept;
+	block_type* sparsestBlock() const noexcept;
+	template< typename... Args >
+	iterator insertValue(Args&&... args);
+	template< typename... Args >
+	iterator insertInDeletedCell(Args&&... args);
+	template< typename... Args >
+	iterator insertBody(Args&&... args);
+	void adopt(BucketStorage& replacement) noexcept;
+	static std::uint64_t location(const block_type* block, size_type slot) noexcept;
+	void traceElement(StorageEvent event, const block_type* block, size_type slot, std::uint64_t previous = 0) const;
+	static void releaseBlock(const block_type* block) noexcept;
+
+	template< typename U >
+	static void writeValue(std::ostream& out, const U& value);
+	template< typename U >
+	static U readValue(std::istream& in);
+	template< typename Serializer >
+	static void writeHeader(std::ostream& out, size_type min_block_capacity, size_type max_block_capacity, size_type size, size_type block_count);
+	template< typename Serializer >
+	static void writeBlock(std::ostream& out, const block_type& block, Serializer& serializer);
+	template< typename Deserializer >
+	void readBlock(std::istream& in, Deserializer& deserializer);
 
   public:
 	iterator begin() noexcept;
@@ -639,7 +1137,13 @@ class BucketStorage
 	const_iterator cbegin() const noexcept;
 	const_iterator cend() const noexcept;
 
-	explicit BucketStorage(size_type block_capacity = 64);
+	// One page per block by default, see BlockSizeTraits.
+	static constexpr size_type default_block_capacity =
+		Block< T >::fittingCapacity(BlockSizeTraits< T >::target_bytes, BlockSizeTraits< T >::min_capacity);
+
+	BucketStorage() noexcept(std::is_nothrow_default_constructible_v< Instrumentation >);
+	explicit BucketStorage(size_type block_capacity);
+	BucketStorage(size_type min_block_capacity, size_type max_block_capacity);
 	BucketStorage(const BucketStorage& other);
 	BucketStorage(BucketStorage&& other) noexcept;
 	BucketStorage& operator=(const BucketStorage& other);
@@ -647,605 +1151,2129 @@ class BucketStorage
 
 	iterator insert(const value_type& value);
 	iterator insert(value_type&& value);
-	iterator erase(iterator pos);
+	template< typename... Args >
+	iterator emplace(Args&&... args);
+	iterator erase(const_iterator pos);
+	bool erase(const Handle& handle);
 
 	iterator get_to_distance(iterator iter, const difference_type distance);
 
+	Handle handle(const_iterator pos) const noexcept;
+	pointer get(const Handle& handle);
+	const_pointer get(const Handle& handle) const noexcept;
+
 	[[nodiscard]] size_type size() const noexcept;
 	[[nodiscard]] bool empty() const noexcept;
 	[[nodiscard]] size_type capacity() const noexcept;
 
+	Snapshot snapshot() const;
+	[[nodiscard]] Stats stats() const;
+	[[nodiscard]] ReusePolicy reuse_policy() const noexcept;
+	void set_reuse_policy(ReusePolicy policy) noexcept;
+	void set_bounds(size_type max_size, size_type max_bytes = 0, evict_callback on_evict = evict_callback());
+	void enable_expiry() noexcept;
+	[[nodiscard]] bool expiry_enabled() const noexcept;
+	[[nodiscard]] time_point insert_time() const noexcept;
+	void set_insert_time(time_point now) noexcept;
+	void reset_insert_time() noexcept;
+	size_type expire_older_than(time_point time);
+	template< typename Predicate >
+	size_type expire_older_than(time_point time, Predicate expired);
+	Instrumentation& instrumentation() noexcept;
+	const Instrumentation& instrumentation() const noexcept;
+
 	void clear() noexcept;
+	void clear_keep_capacity() noexcept;
 	~BucketStorage();
 	void shrink_to_fit();
+	template< typename Callback >
+	size_type compact_step(size_type budget, Callback&& on_move);
+	void merge(BucketStorage&& other);
+	BucketStorage extract_blocks(size_type first, size_type last);
+	std::vector< BucketStorage > split(size_type parts);
+	template< typename Predicate >
+	BucketStorage partition(Predicate pred);
+
+	template< typename Serializer = RawSerializer >
+	void save(std::ostream& out, Serializer serializer = Serializer()) const;
+	template< typename Serializer = RawSerializer >
+	void save(const std::string& path, Serializer serializer = Serializer()) const;
+	template< typename Deserializer = RawSerializer >
+	void load(std::istream& in, Deserializer deserializer = Deserializer());
+	template< typename Deserializer = RawSerializer >
+	void load(const std::string& path, Deserializer deserializer = Deserializer());
+
+	template< typename Serializer = RawSerializer >
+	[[nodiscard]] std::future< void > checkpoint_async(const std::string& path, Serializer serializer = Serializer()) const;
 	void swap(BucketStorage& other) noexcept;
 };
 
-template< typename T >
+template< typename T, typename Instrumentation >
 template< bool IsConst >
-BucketStorage< T >::Iterator< IsConst >::Iterator(element_type_* current_node, end_pointer_type end, Block< T >* current_block, size_type block_capacity) :
-	current_node_(current_node), end_(end), current_block_(current_block), block_capacity_(block_capacity)
+BucketStorage< T, Instrumentation >::Iterator< IsConst >::Iterator(storage_pointer owner, Block< T >* current_block, size_type current_index) :
+	owner_(owner), current_block_(current_block ? current_block->getId() : no_block), current_index_(current_index)
 {
 }
 
-template< typename T >
+template< typename T, typename Instrumentation >
 template< bool IsConst >
-BucketStorage< T >::Iterator< IsConst >::Iterator(element_type_* current_node, end_pointer_type end, Block< T >* current_block, size_type block_capacity, size_type current_position) :
-	current_node_(current_node), end_(end), current_block_(current_block), block_capacity_(block_capacity),
+BucketStorage< T, Instrumentation >::Iterator< IsConst >::Iterator(storage_pointer owner, Block< T >* current_block, size_type current_index, size_type current_position) :
+	owner_(owner), current_block_(current_block ? current_block->getId() : no_block), current_index_(current_index),
 	current_position_(current_position)
 {
 }
 
-template< typename T >
+template< typename T, typename Instrumentation >
 template< bool IsConst >
-BucketStorage< T >::Iterator< IsConst >::Iterator(const Iterator& other) :
-	current_node_(other.current_node_), current_block_(other.current_block_), block_capacity_(other.block_capacity_),
-	current_position_(other.current_position_), end_(other.end_)
+BucketStorage< T, Instrumentation >::Iterator< IsConst >::Iterator(const Iterator& other) :
+	owner_(other.owner_), current_block_(other.current_block_), current_index_(other.current_index_),
+	current_position_(other.current_position_)
 {
 }
 
-template< typename T >
+template< typename T, typename Instrumentation >
 template< bool IsConst >
-typename BucketStorage< T >::template Iterator< IsConst >::element_type_* BucketStorage< T >::Iterator< IsConst >::getCurrent() const
+template< bool OtherIsConst, typename >
+BucketStorage< T, Instrumentation >::Iterator< IsConst >::Iterator(const Iterator< OtherIsConst >& other) :
+	owner_(other.owner_), current_block_(other.current_block_), current_index_(other.current_index_),
+	current_position_(other.current_position_)
 {
-	if (current_node_ == nullptr)
-		return ((element_type_*)(*end_)) + 1;
-
-	return current_node_;
 }
 
-template< typename T >
+template< typename T, typename Instrumentation >
 template< bool IsConst >
-bool BucketStorage< T >::Iterator< IsConst >::operator==(const Iterator& other) const
+bool BucketStorage< T, Instrumentation >::Iterator< IsConst >::operator==(const Iterator& other) const
 {
-	return getCurrent() == other.getCurrent();
+	return current_block_ == other.current_block_ && (current_block_ == no_block || current_index_ == other.current_index_);
 }
 
-template< typename T >
+template< typename T, typename Instrumentation >
 template< bool IsConst >
-bool BucketStorage< T >::Iterator< IsConst >::operator!=(const Iterator& other) const
+bool BucketStorage< T, Instrumentation >::Iterator< IsConst >::operator!=(const Iterator& other) const
 {
 	return !(*this == other);
 }
 
-template< typename T >
+template< typename T, typename Instrumentation >
 template< bool IsConst >
 template< bool OtherIsConst >
-bool BucketStorage< T >::Iterator< IsConst >::operator==(const Iterator< OtherIsConst >& other) const
+bool BucketStorage< T, Instrumentation >::Iterator< IsConst >::operator==(const Iterator< OtherIsConst >& other) const
 {
-	return getCurrent() == other.getCurrent();
+	return current_block_ == other.current_block_ && (current_block_ == no_block || current_index_ == other.current_index_);
 }
 
-template< typename T >
+template< typename T, typename Instrumentation >
 template< bool IsConst >
 template< bool OtherIsConst >
-bool BucketStorage< T >::Iterator< IsConst >::operator!=(const Iterator< OtherIsConst >& other) const
+bool BucketStorage< T, Instrumentation >::Iterator< IsConst >::operator!=(const Iterator< OtherIsConst >& other) const
 {
 	return !(*this == other);
 }
 
-template< typename T >
+template< typename T, typename Instrumentation >
 template< bool IsConst >
-typename BucketStorage< T >::template Iterator< IsConst >& BucketStorage< T >::Iterator< IsConst >::operator++()
+typename BucketStorage< T, Instrumentation >::template Iterator< IsConst >& BucketStorage< T, Instrumentation >::Iterator< IsConst >::operator++()
 {
-	if (current_node_ == nullptr)
-	{
-		auto* temp = (element_type_*)(*end_);
-		current_node_ = temp;
+	const auto* current = getCurrentBlock();
+	if (current == nullptr)
 		return *this;
-	}
 
-	if (!current_node_->getNext())
-		current_node_ = current_node_ + 1;
-	else
+	size_type next = current->getElement(current_index_).getNext();
+	if (next == npos)
 	{
-		current_node_ = current_node_->getNext();
-		while (current_node_->getNext() && !current_node_->isActive())
-			current_node_ = current_node_->getNext();
-
-		current_block_ = current_node_->getIndex() == 0 ? current_block_->getNext() : current_block_;
+		auto* block = current->getNext();
+		while (block && block->getFirst() == npos)
+			block = block->getNext();
+
+		current_block_ = block ? block->getId() : no_block;
+		next = block ? block->getFirst() : 0;
+		if constexpr (Instrumentation::enabled)
+			owner_->instrumentation_.record(block ? StorageEvent::BlockHop : StorageEvent::Iterate, std::chrono::nanoseconds::zero());
 	}
 
+	current_index_ = next;
 	current_position_++;
 
 	return *this;
 }
 
-template< typename T >
+template< typename T, typename Instrumentation >
 template< bool IsConst >
-typename BucketStorage< T >::template Iterator< IsConst > BucketStorage< T >::Iterator< IsConst >::operator++(int)
+typename BucketStorage< T, Instrumentation >::template Iterator< IsConst > BucketStorage< T, Instrumentation >::Iterator< IsConst >::operator++(int)
 {
 	Iterator temp = *this;
 	++(*this);
 	return temp;
 }
 
-template< typename T >
+template< typename T, typename Instrumentation >
 template< bool IsConst >
-typename BucketStorage< T >::template Iterator< IsConst >& BucketStorage< T >::Iterator< IsConst >::operator--()
+typename BucketStorage< T, Instrumentation >::template Iterator< IsConst >& BucketStorage< T, Instrumentation >::Iterator< IsConst >::operator--()
 {
-	if (current_node_ == nullptr)
-	{
-		current_node_ = *end_;
-		return *this;
-	}
-
-	if (!current_node_->getPrevious())
-		current_node_ = current_node_ + 1;
-	else
+	const auto* current = getCurrentBlock();
+	size_type previous = current ? current->getElement(current_index_).getPrevious() : npos;
+	if (previous == npos)
 	{
-		current_node_ = current_node_->getPrevious();
-		current_block_ = current_node_->getNext()->getIndex() == 0 ? current_block_->getPrevious() : current_block_;
+		auto* block = current ? current->getPrevious() : owner_->tail_block_;
+		while (block && block->getLast() == npos)
+			block = block->getPrevious();
+
+		current_block_ = block ? block->getId() : no_block;
+		previous = block ? block->getLast() : 0;
+		if constexpr (Instrumentation::enabled)
+			if (block)
+				owner_->instrumentation_.record(StorageEvent::BlockHop, std::chrono::nanoseconds::zero());
 	}
 
+	current_index_ = previous;
 	current_position_--;
 
 	return *this;
 }
 
-template< typename T >
+template< typename T, typename Instrumentation >
 template< bool IsConst >
-typename BucketStorage< T >::template Iterator< IsConst > BucketStorage< T >::Iterator< IsConst >::operator--(int)
+typename BucketStorage< T, Instrumentation >::template Iterator< IsConst > BucketStorage< T, Instrumentation >::Iterator< IsConst >::operator--(int)
 {
 	Iterator temp = *this;
 	--(*this);
 	return temp;
 }
 
-template< typename T >
+template< typename T, typename Instrumentation >
 template< bool IsConst >
-bool BucketStorage< T >::Iterator< IsConst >::operator<(const Iterator& other) const
+bool BucketStorage< T, Instrumentation >::Iterator< IsConst >::operator<(const Iterator& other) const
 {
 	return current_position_ < other.current_position_;
 }
 
-template< typename T >
+template< typename T, typename Instrumentation >
 template< bool IsConst >
-bool BucketStorage< T >::Iterator< IsConst >::operator>(const Iterator& other) const
+bool BucketStorage< T, Instrumentation >::Iterator< IsConst >::operator>(const Iterator& other) const
 {
 	return current_position_ > other.current_position_;
 }
 
-template< typename T >
+template< typename T, typename Instrumentation >
 template< bool IsConst >
-bool BucketStorage< T >::Iterator< IsConst >::operator<=(const Iterator& other) const
+bool BucketStorage< T, Instrumentation >::Iterator< IsConst >::operator<=(const Iterator& other) const
 {
 	return current_position_ <= other.current_position_;
 }
 
-template< typename T >
+template< typename T, typename Instrumentation >
 template< bool IsConst >
-bool BucketStorage< T >::Iterator< IsConst >::operator>=(const Iterator& other) const
+bool BucketStorage< T, Instrumentation >::Iterator< IsConst >::operator>=(const Iterator& other) const
 {
 	return current_position_ >= other.current_position_;
 }
 
-template< typename T >
+template< typename T, typename Instrumentation >
 template< bool IsConst >
-typename BucketStorage< T >::template Iterator< IsConst >::reference BucketStorage< T >::Iterator< IsConst >::operator*() const
+typename BucketStorage< T, Instrumentation >::template Iterator< IsConst >::reference BucketStorage< T, Instrumentation >::Iterator< IsConst >::operator*() const
 {
-	return *current_node_->getValue();
+	// A mutable reference may be written through, so it needs a block of its
+	// own; read through a const_iterator to leave a shared block alone.
+	if constexpr (!IsConst)
+		return owner_->detachBlock(getCurrentBlock())->getValue(current_index_);
+	else
+		return getCurrentBlock()->getValue(current_index_);
 }
 
-template< typename T >
+template< typename T, typename Instrumentation >
 template< bool IsConst >
-typename BucketStorage< T >::template Iterator< IsConst >::pointer BucketStorage< T >::Iterator< IsConst >::operator->() const
+typename BucketStorage< T, Instrumentation >::template Iterator< IsConst >::pointer BucketStorage< T, Instrumentation >::Iterator< IsConst >::operator->() const
 {
-	return &*current_node_->getValue();
+	return &**this;
 }
 
-template< typename T >
+template< typename T, typename Instrumentation >
 template< bool IsConst >
-typename BucketStorage< T >::block_type* BucketStorage< T >::Iterator< IsConst >::getCurrentBlock()
+typename BucketStorage< T, Instrumentation >::block_type* BucketStorage< T, Instrumentation >::Iterator< IsConst >::getCurrentBlock() const
 {
-	return current_block_;
+	return current_block_ == no_block ? nullptr : owner_->blocks_[current_block_].block;
 }
 
-template< typename T >
+template< typename T, typename Instrumentation >
 template< bool IsConst >
-typename BucketStorage< T >::template Iterator< IsConst >::element_type_*
-	BucketStorage< T >::Iterator< IsConst >::getCurrentElement()
+typename BucketStorage< T, Instrumentation >::size_type BucketStorage< T, Instrumentation >::Iterator< IsConst >::getCurrentIndex() const
 {
-	return current_node_;
+	return current_index_;
 }
 
-template< typename T >
-void BucketStorage< T >::addBlock()
+template< typename T, typename Instrumentation >
+template< bool IsConst >
+typename BucketStorage< T, Instrumentation >::size_type BucketStorage< T, Instrumentation >::Iterator< IsConst >::getCurrentPosition() const
 {
-	auto* new_block = new block_type();
-	new_block->setBlockCapacity(block_capacity_);
-	new_block->setElements(new element_type[block_capacity_]);
-	new_block->getElement(0).setPrevious(last_object_);
-	last_object_->setNext(&new_block->getElement(0));
-	new_block->setPrevious(tail_block_);
-	tail_block_->setNext(new_block);
-	tail_block_ = new_block;
+	return current_position_;
 }
 
-template< typename T >
-void BucketStorage< T >::delBlock(block_type* block)
+template< typename T, typename Instrumentation >
+constexpr BucketStorage< T, Instrumentation >::Handle::Handle(std::uint32_t block, std::uint32_t epoch, std::uint32_t slot, std::uint32_t generation) noexcept :
+	block_(block), epoch_(epoch), slot_(slot), generation_(generation)
 {
-	if (!block->getPrevious() && !block->getNext())
-	{
-		clear();
-		initializationContainer();
-		return;
-	}
-
-	if (block->getPrevious() && block->getNext())
-	{
-		block->getPrevious()->setNext(block->getNext());
-		block->getNext()->setPrevious(block->getPrevious());
-
-		block->getPrevious()->getElement(block_capacity_ - size_type(1)).setNext(&block->getNext()->getElement(0));
-		block->getNext()->getElement(0).setPrevious(&block->getPrevious()->getElement(block_capacity_ - size_type(1)));
-	}
-	else if (block->getPrevious() && !block->getNext())
-	{
-		block->getPrevious()->setNext(nullptr);
-		block->getPrevious()->getElement(block_capacity_ - size_type(1)).setNext(nullptr);
-		last_object_ = &block->getPrevious()->getElement(block_capacity_ - size_type(1));
-	}
-	else if (!block->getPrevious() && block->getNext())
-	{
-		head_block_ = block->getNext();
-		block->getNext()->setPrevious(nullptr);
-		block->getNext()->getElement(0).setPrevious(nullptr);
-		first_element_ = &block->getNext()->getElement(0);
-	}
+}
 
-	Stack< block_type* > new_last_deleting;
-	while (!last_deleting_.empty())
-	{
-		auto* link = last_deleting_.top();
-		last_deleting_.pop();
-		if (link != block)
-			new_last_deleting.add(link);
-	}
+template< typename T, typename Instrumentation >
+constexpr std::uint32_t BucketStorage< T, Instrumentation >::Handle::getBlock() const noexcept
+{
+	return block_;
+}
 
-	last_deleting_ = new_last_deleting;
-	current_index_ -= block_capacity_;
+template< typename T, typename Instrumentation >
+constexpr std::uint32_t BucketStorage< T, Instrumentation >::Handle::getEpoch() const noexcept
+{
+	return epoch_;
+}
 
-	delete block;
+template< typename T, typename Instrumentation >
+constexpr std::uint32_t BucketStorage< T, Instrumentation >::Handle::getSlot() const noexcept
+{
+	return slot_;
 }
 
-template< typename T >
-typename BucketStorage< T >::element_type* BucketStorage< T >::insertInDeletedCellBody()
+template< typename T, typename Instrumentation >
+constexpr std::uint32_t BucketStorage< T, Instrumentation >::Handle::getGeneration() const noexcept
 {
-	auto* top_block = last_deleting_.top();
-	last_deleting_.pop();
+	return generation_;
+}
 
-	auto top_deleted_element = top_block->getDeletedCells().top();
-	top_block->getDeletedCells().pop();
+template< typename T, typename Instrumentation >
+constexpr bool BucketStorage< T, Instrumentation >::Handle::operator==(const Handle& other) const noexcept
+{
+	return block_ == other.block_ && epoch_ == other.epoch_ && slot_ == other.slot_ && generation_ == other.generation_;
+}
 
-	top_deleted_element.getLeft()->setNext(top_deleted_element.getPosition());
-	top_deleted_element.getRight()->setPrevious(top_deleted_element.getPosition());
+template< typename T, typename Instrumentation >
+constexpr bool BucketStorage< T, Instrumentation >::Handle::operator!=(const Handle& other) const noexcept
+{
+	return !(*this == other);
+}
 
-	top_deleted_element.getPosition()->setPrevious(top_deleted_element.getLeft());
-	top_deleted_element.getPosition()->setNext(top_deleted_element.getLeft());
+template< typename T, typename Instrumentation >
+BucketStorage< T, Instrumentation >::Snapshot::ConstIterator::ConstIterator(const std::vector< const Block< T >* >* blocks, size_type current_block) :
+	blocks_(blocks), current_block_(current_block)
+{
+	while (current_block_ < blocks_->size() && (*blocks_)[current_block_]->getFirst() == npos)
+		++current_block_;
 
-	return top_deleted_element.getPosition();
+	if (current_block_ < blocks_->size())
+		current_index_ = (*blocks_)[current_block_]->getFirst();
 }
 
-template< typename T >
-typename BucketStorage< T >::iterator BucketStorage< T >::insertInDeletedCell(const value_type& value)
+template< typename T, typename Instrumentation >
+bool BucketStorage< T, Instrumentation >::Snapshot::ConstIterator::operator==(const ConstIterator& other) const
 {
-	element_type* position = insertInDeletedCellBody();
-
-	position->setValue(new value_type(value));
-	position->setIsActive(true);
+	return current_block_ == other.current_block_ && current_index_ == other.current_index_;
+}
 
-	return iterator(position, &last_object_, head_block_, block_capacity_);
+template< typename T, typename Instrumentation >
+bool BucketStorage< T, Instrumentation >::Snapshot::ConstIterator::operator!=(const ConstIterator& other) const
+{
+	return !(*this == other);
 }
 
-template< typename T >
-typename BucketStorage< T >::iterator BucketStorage< T >::insertInDeletedCell(value_type&& value)
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::Snapshot::ConstIterator& BucketStorage< T, Instrumentation >::Snapshot::ConstIterator::operator++()
 {
-	element_type* position = insertInDeletedCellBody();
+	const size_type next = (*blocks_)[current_block_]->getElement(current_index_).getNext();
+	if (next != npos)
+	{
+		current_index_ = next;
+		return *this;
+	}
 
-	position->setValue(new value_type(std::move(value)));
-	position->setIsActive(true);
+	*this = ConstIterator(blocks_, current_block_ + 1);
+	return *this;
+}
 
-	return iterator(position, &last_object_, head_block_, block_capacity_);
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::Snapshot::ConstIterator BucketStorage< T, Instrumentation >::Snapshot::ConstIterator::operator++(int)
+{
+	ConstIterator temp = *this;
+	++(*this);
+	return temp;
 }
 
-template< typename T >
-void BucketStorage< T >::insertBody()
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::Snapshot::ConstIterator::reference BucketStorage< T, Instrumentation >::Snapshot::ConstIterator::operator*() const
 {
-	size_type current_block = current_index_ / block_capacity_;
-	size_type inner_index = current_index_ % block_capacity_;
+	return (*blocks_)[current_block_]->getValue(current_index_);
+}
 
-	if (current_block > 0 && inner_index == 0)
-		addBlock();
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::Snapshot::ConstIterator::pointer BucketStorage< T, Instrumentation >::Snapshot::ConstIterator::operator->() const
+{
+	return &**this;
+}
 
-	if (first_element_ == nullptr)
-		first_element_ = &tail_block_->getElement(0);
+template< typename T, typename Instrumentation >
+BucketStorage< T, Instrumentation >::Snapshot::Snapshot(std::vector< const Block< T >* > blocks, size_type size, size_type min_block_capacity, size_type max_block_capacity) noexcept :
+	blocks_(std::move(blocks)), size_(size), min_block_capacity_(min_block_capacity), max_block_capacity_(max_block_capacity)
+{
+}
 
-	element_type* elements = tail_block_->getElements();
+template< typename T, typename Instrumentation >
+BucketStorage< T, Instrumentation >::Snapshot::Snapshot(const Snapshot& other) :
+	blocks_(other.blocks_), size_(other.size_), min_block_capacity_(other.min_block_capacity_),
+	max_block_capacity_(other.max_block_capacity_)
+{
+	for (const auto* block : blocks_)
+		block->retain();
+}
 
-	elements[inner_index].setIndex(inner_index);
-	last_object_ = &elements[inner_index];
+template< typename T, typename Instrumentation >
+BucketStorage< T, Instrumentation >::Snapshot::Snapshot(Snapshot&& other) noexcept :
+	blocks_(std::move(other.blocks_)), size_(other.size_), min_block_capacity_(other.min_block_capacity_),
+	max_block_capacity_(other.max_block_capacity_)
+{
+	other.blocks_.clear();
+	other.size_ = 0;
+}
 
-	if ((inner_index + 1) % block_capacity_ != 0)
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::Snapshot& BucketStorage< T, Instrumentation >::Snapshot::operator=(const Snapshot& other)
+{
+	if (this != &other)
 	{
-		elements[inner_index].setNext(&elements[inner_index + 1]);
-		elements[inner_index + 1].setPrevious(&elements[inner_index]);
+		Snapshot copy(other);
+		swap(copy);
 	}
+	return *this;
+}
 
-	current_index_++;
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::Snapshot& BucketStorage< T, Instrumentation >::Snapshot::operator=(Snapshot&& other) noexcept
+{
+	if (this != &other)
+	{
+		release();
+		swap(other);
+	}
+	return *this;
 }
 
-template< typename T >
-void BucketStorage< T >::initializationContainer()
+template< typename T, typename Instrumentation >
+BucketStorage< T, Instrumentation >::Snapshot::~Snapshot()
 {
-	head_block_ = new block_type();
-	head_block_->setElements(new element_type[block_capacity_]);
-	head_block_->setBlockCapacity(block_capacity_);
-	tail_block_ = head_block_;
+	release();
 }
 
-template< typename T >
-typename BucketStorage< T >::iterator BucketStorage< T >::begin() noexcept
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::Snapshot::release() noexcept
 {
-	return iterator(head_block_ ? first_element_ : nullptr, &last_object_, head_block_, block_capacity_);
+	for (const auto* block : blocks_)
+		releaseBlock(block);
+
+	blocks_.clear();
+	size_ = 0;
 }
 
-template< typename T >
-typename BucketStorage< T >::iterator BucketStorage< T >::end() noexcept
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::Snapshot::const_iterator BucketStorage< T, Instrumentation >::Snapshot::begin() const noexcept
 {
-	return iterator(nullptr, &last_object_, tail_block_, block_capacity_, current_index_);
+	return const_iterator(&blocks_, 0);
 }
 
-template< typename T >
-typename BucketStorage< T >::const_iterator BucketStorage< T >::begin() const noexcept
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::Snapshot::const_iterator BucketStorage< T, Instrumentation >::Snapshot::end() const noexcept
 {
-	return const_iterator(head_block_ ? first_element_ : nullptr, &last_object_, head_block_, block_capacity_);
+	return const_iterator(&blocks_, blocks_.size());
 }
 
-template< typename T >
-typename BucketStorage< T >::const_iterator BucketStorage< T >::end() const noexcept
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::size_type BucketStorage< T, Instrumentation >::Snapshot::size() const noexcept
 {
-	return const_iterator(nullptr, &last_object_, tail_block_, block_capacity_, current_index_);
+	return size_;
 }
 
-template< typename T >
-typename BucketStorage< T >::const_iterator BucketStorage< T >::cbegin() const noexcept
+template< typename T, typename Instrumentation >
+bool BucketStorage< T, Instrumentation >::Snapshot::empty() const noexcept
 {
-	return const_iterator(head_block_ ? first_element_ : nullptr, &last_object_, head_block_, block_capacity_);
+	return size_ == 0;
 }
 
-template< typename T >
-typename BucketStorage< T >::const_iterator BucketStorage< T >::cend() const noexcept
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::Snapshot::swap(Snapshot& other) noexcept
 {
-	return const_iterator(nullptr, &last_object_, tail_block_, block_capacity_, current_index_);
+	blocks_.swap(other.blocks_);
+	std::swap(size_, other.size_);
+	std::swap(min_block_capacity_, other.min_block_capacity_);
+	std::swap(max_block_capacity_, other.max_block_capacity_);
 }
 
-template< typename T >
-BucketStorage< T >::BucketStorage(size_type block_capacity) : block_capacity_(block_capacity)
+template< typename T, typename Instrumentation >
+template< typename Serializer >
+void BucketStorage< T, Instrumentation >::Snapshot::save(std::ostream& out, Serializer serializer) const
 {
-	if (block_capacity == 0)
-		throw std::invalid_argument("The block size cannot be equal to 0.");
+	writeHeader< Serializer >(out, min_block_capacity_, max_block_capacity_, size_, blocks_.size());
+
+	for (const auto* block : blocks_)
+		writeBlock(out, *block, serializer);
 
-	initializationContainer();
+	if (!out)
+		throw std::runtime_error("Cannot write BucketStorage dump.");
 }
 
-template< typename T >
-BucketStorage< T >::BucketStorage(const BucketStorage& other) :
-	size_(other.size_), block_capacity_(other.block_capacity_), current_index_(0)
+template< typename T, typename Instrumentation >
+template< typename Serializer >
+void BucketStorage< T, Instrumentation >::Snapshot::save(const std::string& path, Serializer serializer) const
 {
-	initializationContainer();
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	if (!out)
+		throw std::runtime_error("Cannot open " + path + " for writing.");
 
-	if (!other.head_block_)
-		return;
+	save(out, std::move(serializer));
+}
+
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::addBlock()
+{
+	EventScope< Instrumentation > scope(instrumentation_, StorageEvent::AddBlock);
+	if (inline_capacity != 0 && block_count_ == 0)
+		linkBlock(block_type::create(inline_capacity, inlineMemory()));
+	else
+		linkBlock(block_type::create(nextBlockCapacity()));
+}
 
-	const_iterator iter = other.begin();
-	const_iterator end_ = other.end();
+template< typename T, typename Instrumentation >
+void* BucketStorage< T, Instrumentation >::inlineMemory() noexcept
+{
+	if constexpr (inline_capacity != 0)
+		return inline_.bytes;
+	else
+		return nullptr;
+}
 
-	while (iter != end_)
-	{
-		if (iter.getCurrentElement()->isActive() && iter.getCurrentElement()->getValue())
-			insert(*iter.getCurrentElement()->getValue());
-		++iter;
-	}
+// Moves an embedded block to memory, another embedded block slot, or to
+// the heap for nullptr, and points the storage at the moved block.
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::block_type* BucketStorage< T, Instrumentation >::relocateBlock(block_type* block, void* memory)
+{
+	auto* moved = block_type::relocate(*block, memory);
+	replaceBlock(block, moved);
+	block_type::dispose(block);
+	return moved;
 }
 
-template< typename T >
-BucketStorage< T >::BucketStorage(BucketStorage&& other) noexcept :
-	last_deleting_(std::move(other.last_deleting_)), head_block_(other.head_block_), tail_block_(other.tail_block_),
-	last_object_(other.last_object_), first_element_(other.first_element_), size_(other.size_),
-	block_capacity_(other.block_capacity_), current_index_(other.current_index_)
-{
-	other.head_block_ = nullptr;
-	other.tail_block_ = nullptr;
-	other.last_object_ = nullptr;
-	other.first_element_ = nullptr;
-	other.size_ = 0;
-	other.block_capacity_ = 0;
-	other.current_index_ = 0;
+// Each new block matches the capacity already allocated, within the bounds,
+// so the total capacity doubles from min_block_capacity_ until blocks reach
+// max_block_capacity_.
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::size_type BucketStorage< T, Instrumentation >::nextBlockCapacity() const noexcept
+{
+	return std::clamp(capacity_, min_block_capacity_, max_block_capacity_);
 }
 
-template< typename T >
-BucketStorage< T >& BucketStorage< T >::operator=(const BucketStorage& other)
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::linkBlock(block_type* new_block)
 {
-	if (this == &other)
-		return *this;
+	try
+	{
+		registerBlock(new_block);
+	} catch (...)
+	{
+		block_type::dispose(new_block);
+		throw;
+	}
+	new_block->setPrevious(tail_block_);
 
-	BucketStorage< T > copy(other);
-	swap(copy);
+	if (tail_block_)
+		tail_block_->setNext(new_block);
+	else
+		head_block_ = new_block;
 
-	return *this;
+	tail_block_ = new_block;
+	capacity_ += new_block->getBlockCapacity();
+	block_bytes_ += block_type::allocationSize(new_block->getBlockCapacity());
+	++block_count_;
+	++block_allocations_;
 }
 
-template< typename T >
-BucketStorage< T >& BucketStorage< T >::operator=(BucketStorage&& other) noexcept
+// Copies the topology of other block by block: same capacities, same ids
+// and slots, so handles into other also resolve in the copy, and the
+// deleting lists are mirrored. Only the values themselves are copied.
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::cloneBlocks(const BucketStorage& other)
 {
-	if (this != &other)
+	blocks_.resize(other.blocks_.size());
+
+	try
+	{
+		for (const auto* block = other.head_block_; block != nullptr; block = block->getNext())
+		{
+			auto* copy = block_type::clone(*block, block->isEmbedded() ? inlineMemory() : nullptr);
+			blocks_[copy->getId()].block = copy;
+			copy->setPrevious(tail_block_);
+
+			if (tail_block_)
+				tail_block_->setNext(copy);
+			else
+				head_block_ = copy;
+
+			tail_block_ = copy;
+			capacity_ += copy->getBlockCapacity();
+			block_bytes_ += block_type::allocationSize(copy->getBlockCapacity());
+			++block_count_;
+			++block_allocations_;
+		}
+	} catch (...)
 	{
 		clear();
-		initializationContainer();
-		swap(other);
+		throw;
 	}
-	return *this;
-}
 
-template< typename T >
-typename BucketStorage< T >::iterator BucketStorage< T >::insert(const value_type& value)
-{
-	if (!last_deleting_.empty())
-		return insertInDeletedCell(value);
+	auto mirror = [this](const block_type* block) { return block ? blocks_[block->getId()].block : nullptr; };
+
+	for (std::uint32_t id = 0; id < blocks_.size(); ++id)
+	{
+		blocks_[id].epoch = other.blocks_[id].epoch;
+		blocks_[id].next_free = other.blocks_[id].next_free;
+
+		if (auto* copy = blocks_[id].block)
+		{
+			const block_type* block = other.blocks_[id].block;
+			copy->setNextDeleting(mirror(block->getNextDeleting()));
+			copy->setPreviousDeleting(mirror(block->getPreviousDeleting()));
+		}
+	}
 
-	size_type inner_index = current_index_ % block_capacity_;
+	for (std::uint32_t bucket = 0; bucket < deleting_buckets; ++bucket)
+		deleting_[bucket] = mirror(other.deleting_[bucket]);
 
-	insertBody();
+	fill_block_ = mirror(other.fill_block_);
+	free_block_id_ = other.free_block_id_;
+	deleting_mask_ = other.deleting_mask_;
+	size_ = other.size_;
+}
 
-	Element< T >* elements = tail_block_->getElements();
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::delBlock(block_type* block)
+{
+	EventScope< Instrumentation > scope(instrumentation_, StorageEvent::DelBlock);
+	popDeleting(block);
 
-	elements[inner_index].setValue(new value_type(value));
-	elements[inner_index].setIsActive(true);
+	if (!block->getPrevious() && !block->getNext())
+	{
+		block->reset();
+		return;
+	}
 
-	size_++;
+	dropBlock(block);
+}
 
-	return iterator(&elements[inner_index], &last_object_, head_block_, block_capacity_);
+// Unlinks a block from the chain and frees it; the deleting lists are left
+// to the caller.
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::dropBlock(block_type* block) noexcept
+{
+	unlinkBlock(block);
+	++block_frees_;
+	releaseBlock(block);
 }
 
-template< typename T >
-typename BucketStorage< T >::iterator BucketStorage< T >::insert(value_type&& value)
+// Takes a block and its elements out of the chain and the block table,
+// without freeing it.
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::unlinkBlock(block_type* block) noexcept
 {
-	if (!last_deleting_.empty())
-		return insertInDeletedCell(std::move(value));
+	if (fill_block_ == block)
+		fill_block_ = block->getNext();
 
-	size_type inner_index = current_index_ % block_capacity_;
+	if (block->getPrevious())
+		block->getPrevious()->setNext(block->getNext());
+	else
+		head_block_ = block->getNext();
 
-	insertBody();
+	if (block->getNext())
+		block->getNext()->setPrevious(block->getPrevious());
+	else
+		tail_block_ = block->getPrevious();
 
-	tail_block_->getElement(inner_index).setValue(new value_type(std::move(value)));
-	tail_block_->getElement(inner_index).setIsActive(true);
+	block->setPrevious(nullptr);
+	block->setNext(nullptr);
+	size_ -= block->getSize();
+	capacity_ -= block->getBlockCapacity();
+	block_bytes_ -= block_type::allocationSize(block->getBlockCapacity());
+	--block_count_;
+	unregisterBlock(block);
+}
 
-	size_++;
+// Links a block taken from another storage behind the tail; its id must
+// already be reserved in blocks_. A tail with unused cells left in the
+// middle of the chain becomes the fill cursor.
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::appendBlock(block_type* block)
+{
+	if (!fill_block_ && tail_block_ && tail_block_->hasUnusedCells())
+		fill_block_ = tail_block_;
 
-	return iterator(&tail_block_->getElement(inner_index), &last_object_, head_block_, block_capacity_);
+	linkBlock(block);
+	size_ += block->getSize();
+	block->setNextDeleting(nullptr);
+	block->setPreviousDeleting(nullptr);
+	if (block->getDeletedCount() != 0)
+		pushDeleting(block);
 }
 
-template< typename T >
-typename BucketStorage< T >::iterator BucketStorage< T >::erase(iterator pos)
+// Moves a block of this storage behind the tail of to. An embedded block
+// moves out of this object first, into the inline slot of an empty to.
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::handOver(block_type* block, BucketStorage& to)
 {
-	auto* block = pos.getCurrentBlock();
-	auto* current_element = pos.getCurrentElement();
+	to.reserveBlockId();
+	if constexpr (inline_capacity != 0)
+		if (block->isEmbedded())
+			block = relocateBlock(block, to.head_block_ ? nullptr : to.inlineMemory());
 
-	last_deleting_.add(block);
-	block->getDeletedCells().add(DeletedCell(current_element->getPrevious(), current_element, current_element->getNext()));
+	popDeleting(block);
+	unlinkBlock(block);
+	++block_frees_;
+	to.appendBlock(block);
+}
 
-	if (current_element != first_element_)
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::block_type* BucketStorage< T, Instrumentation >::detachBlock(block_type* block)
+{
+	if constexpr (std::is_copy_constructible_v< T >)
 	{
-		current_element->getPrevious()->setNext(current_element->getNext());
-		if (current_element->getNext())
-			current_element->getNext()->setPrevious(current_element->getPrevious());
+		if (!block->isShared())
+			return block;
+
+		auto* copy = block_type::clone(*block);
+		replaceBlock(block, copy);
+		releaseBlock(block);
+		++block_allocations_;
+		++block_frees_;
+		return copy;
 	}
 	else
-	{
-		first_element_ = current_element->getNext();
-		first_element_->setPrevious(nullptr);
-	}
+		return block;
+}
 
-	if (current_element->isActive())
-		delete current_element->getValue();
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::replaceBlock(block_type* block, block_type* copy) noexcept
+{
+	blocks_[block->getId()].block = copy;
+	if (fill_block_ == block)
+		fill_block_ = copy;
+	copy->setPrevious(block->getPrevious());
+	copy->setNext(block->getNext());
 
-	current_element->setValue(nullptr);
-	current_element->setIsActive(false);
-	size_--;
-	++pos;
+	if (block->getPrevious())
+		block->getPrevious()->setNext(copy);
+	else
+		head_block_ = copy;
 
-	if (block->getDeletedCells().size() == block_capacity_)
-		delBlock(block);
+	if (block->getNext())
+		block->getNext()->setPrevious(copy);
+	else
+		tail_block_ = copy;
 
-	return pos;
-}
+	if (block->getDeletedCount() == 0)
+		return;
 
-template< typename T >
-typename BucketStorage< T >::iterator BucketStorage< T >::get_to_distance(iterator iter, const difference_type distance)
-{
-	auto new_iter = iterator(iter);
+	copy->setPreviousDeleting(block->getPreviousDeleting());
+	copy->setNextDeleting(block->getNextDeleting());
 
-	if (distance > 0)
-		for (difference_type i = 0; i < distance; ++i)
-			++new_iter;
+	if (block->getPreviousDeleting())
+		block->getPreviousDeleting()->setNextDeleting(copy);
 	else
-		for (difference_type i = distance; i < 0; ++i)
-			--new_iter;
+		deleting_[copy->getDeletingBucket()] = copy;
 
-	return new_iter;
+	if (block->getNextDeleting())
+		block->getNextDeleting()->setPreviousDeleting(copy);
 }
 
-template< typename T >
-typename BucketStorage< T >::size_type BucketStorage< T >::size() const noexcept
+// Lifo always moves the block to the front. FullestBlockFirst leaves it in
+// place while its bucket holds and otherwise files it behind the head, so
+// erases elsewhere never take over from the block being refilled.
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::pushDeleting(block_type* block) noexcept
 {
-	return size_;
-}
+	const bool fullest_first = reuse_policy_ == ReusePolicy::FullestBlockFirst;
+	const std::uint32_t bucket = deletingBucket(block);
+	if (deleting_[bucket] == block)
+		return;
+	if (fullest_first && block->getDeletingBucket() == bucket && block->getPreviousDeleting())
+		return;
 
-template< typename T >
-bool BucketStorage< T >::empty() const noexcept
+	popDeleting(block);
+	block->setDeletingBucket(bucket);
+
+	block_type* head = deleting_[bucket];
+	if (fullest_first && head)
+	{
+		block->setPreviousDeleting(head);
+		block->setNextDeleting(head->getNextDeleting());
+		if (head->getNextDeleting())
+			head->getNextDeleting()->setPreviousDeleting(block);
+		head->setNextDeleting(block);
+		return;
+	}
+
+	block->setNextDeleting(head);
+	if (head)
+		head->setPreviousDeleting(block);
+
+	deleting_[bucket] = block;
+	deleting_mask_ |= 1u << bucket;
+}
+
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::popDeleting(block_type* block) noexcept
+{
+	const std::uint32_t bucket = block->getDeletingBucket();
+	if (deleting_[bucket] != block && !block->getPreviousDeleting())
+		return;
+
+	if (block->getPreviousDeleting())
+		block->getPreviousDeleting()->setNextDeleting(block->getNextDeleting());
+	else
+	{
+		deleting_[bucket] = block->getNextDeleting();
+		if (!deleting_[bucket])
+			deleting_mask_ &= ~(1u << bucket);
+	}
+
+	if (block->getNextDeleting())
+		block->getNextDeleting()->setPreviousDeleting(block->getPreviousDeleting());
+
+	block->setNextDeleting(nullptr);
+	block->setPreviousDeleting(nullptr);
+}
+
+// Lifo keeps one list; FullestBlockFirst files a block under
+// floor(log2(free slots)), so lower buckets hold fuller blocks.
+template< typename T, typename Instrumentation >
+std::uint32_t BucketStorage< T, Instrumentation >::deletingBucket(const block_type* block) const noexcept
+{
+	if (reuse_policy_ == ReusePolicy::Lifo)
+		return 0;
+
+	const auto bucket = static_cast< std::uint32_t >(std::bit_width(block->getDeletedCount())) - 1;
+	return std::min(bucket, deleting_buckets - 1);
+}
+
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::block_type* BucketStorage< T, Instrumentation >::reuseBlock() const noexcept
+{
+	return deleting_mask_ ? deleting_[std::countr_zero(deleting_mask_)] : nullptr;
+}
+
+// Makes sure the next registerBlock() cannot throw.
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::reserveBlockId()
+{
+	if (free_block_id_ != no_block || blocks_.size() < blocks_.capacity())
+		return;
+	if (blocks_.size() >= no_block)
+		throw std::length_error("Too many blocks in BucketStorage.");
+
+	blocks_.reserve(2 * blocks_.size() + 1);
+}
+
+// Drops a block with all its elements in one go; bounds evict the head,
+// the oldest block since blocks are only appended. on_evict sees each
+// element first; if it throws, nothing is dropped. The fill cursor moves
+// on with unlinkBlock(), and an embedded head leaves its inline memory free
+// for the next first block.
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::evictBlock(block_type* block)
+{
+	EventScope< Instrumentation > scope(instrumentation_, StorageEvent::Evict);
+
+	if (on_evict_)
+		for (size_type index = block->getFirst(); index != npos; index = block->getElement(index).getNext())
+			on_evict_(makeHandle(block, index), block->getValue(index));
+	for (size_type index = block->getFirst(); index != npos; index = block->getElement(index).getNext())
+		traceElement(StorageEvent::Erase, block, index);
+
+	popDeleting(block);
+	dropBlock(block);
+}
+
+// Makes room for one more element under max_size_.
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::evictForSize()
+{
+	if (max_size_ != 0)
+		while (size_ >= max_size_)
+			evictBlock(head_block_);
+}
+
+// Makes room for a new block under max_bytes_; set_bounds() made sure one
+// block of min_block_capacity_ always fits.
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::evictForBytes()
+{
+	if (max_bytes_ != 0)
+		while (head_block_ && block_bytes_ + block_type::allocationSize(nextBlockCapacity()) > max_bytes_)
+			evictBlock(head_block_);
+}
+
+// Whether the next insert may have to evict. Errs on the side of true for
+// max_bytes_, since whether a new block is needed is only known later.
+template< typename T, typename Instrumentation >
+bool BucketStorage< T, Instrumentation >::evictionDue() const noexcept
+{
+	return (max_size_ != 0 && size_ >= max_size_) ||
+		   (max_bytes_ != 0 && block_bytes_ + block_type::allocationSize(nextBlockCapacity()) > max_bytes_);
+}
+
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::registerBlock(block_type* block)
+{
+	if (free_block_id_ == no_block)
+	{
+		if (blocks_.size() >= no_block)
+			throw std::length_error("Too many blocks in BucketStorage.");
+		free_block_id_ = static_cast< std::uint32_t >(blocks_.size());
+		blocks_.emplace_back();
+	}
+
+	const std::uint32_t id = free_block_id_;
+	BlockSlot& slot = blocks_[id];
+	free_block_id_ = slot.next_free;
+
+	slot.block = block;
+	++slot.epoch;
+	block->setId(id);
+}
+
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::unregisterBlock(const block_type* block) noexcept
+{
+	BlockSlot& slot = blocks_[block->getId()];
+	slot.block = nullptr;
+	slot.next_free = free_block_id_;
+	free_block_id_ = block->getId();
+}
+
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::block_type* BucketStorage< T, Instrumentation >::findBlock(const Handle& handle) const noexcept
+{
+	if (handle.getBlock() >= blocks_.size())
+		return nullptr;
+
+	const BlockSlot& slot = blocks_[handle.getBlock()];
+	if (!slot.block || slot.epoch != handle.getEpoch() || handle.getSlot() >= slot.block->getUsed())
+		return nullptr;
+
+	const element_type& element = slot.block->getElement(handle.getSlot());
+	if (!element.isActive() || element.getGeneration() != handle.getGeneration())
+		return nullptr;
+
+	return slot.block;
+}
+
+template< typename T, typename Instrumentation >
+template< typename... Args >
+typename BucketStorage< T, Instrumentation >::iterator BucketStorage< T, Instrumentation >::insertInDeletedCell(Args&&... args)
+{
+	EventScope< Instrumentation > scope(instrumentation_, StorageEvent::InsertInDeletedCell);
+	auto* block = detachBlock(reuseBlock());
+	size_type index = block->emplace(std::forward< Args >(args)...);
+	if (expiry_)
+	{
+		const time_point now = stampTime();
+		block->stamp(now, now);
+	}
+
+	if (block->getDeletedCount() == 0)
+		popDeleting(block);
+	else
+		pushDeleting(block);
+
+	size_++;
+
+	return iterator(this, block, index);
+}
+
+template< typename T, typename Instrumentation >
+template< typename... Args >
+typename BucketStorage< T, Instrumentation >::iterator BucketStorage< T, Instrumentation >::insertBody(Args&&... args)
+{
+	if (fill_block_)
+	{
+		while (fill_block_ != tail_block_ && !fill_block_->hasUnusedCells())
+			fill_block_ = fill_block_->getNext();
+		if (fill_block_ == tail_block_)
+			fill_block_ = nullptr;
+	}
+
+	if (!fill_block_ && (!tail_block_ || !tail_block_->hasUnusedCells()))
+	{
+		evictForBytes();
+		addBlock();
+	}
+
+	auto* block = detachBlock(fill_block_ ? fill_block_ : tail_block_);
+	size_type index = block->emplace(std::forward< Args >(args)...);
+	if (expiry_)
+	{
+		const time_point now = stampTime();
+		block->stamp(now, now);
+	}
+
+	size_++;
+
+	return iterator(this, block, index);
+}
+
+// Takes over the blocks of a freshly built replacement, keeping the block
+// counters of this storage; the old blocks leave with the replacement.
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::adopt(BucketStorage& replacement) noexcept
+{
+	replacement.block_allocations_ += block_allocations_;
+	replacement.block_frees_ += block_frees_ + block_count_;
+	swap(replacement);
+}
+
+template< typename T, typename Instrumentation >
+std::uint64_t BucketStorage< T, Instrumentation >::location(const block_type* block, size_type slot) noexcept
+{
+	return static_cast< std::uint64_t >(block->getId()) << 32 | static_cast< std::uint64_t >(slot);
+}
+
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::traceElement(StorageEvent event, const block_type* block, size_type slot, std::uint64_t previous) const
+{
+	if constexpr (requires(Instrumentation& policy) { policy.trace(event, std::uint64_t(), previous); })
+		instrumentation_.trace(event, location(block, slot), previous);
+}
+
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::releaseBlock(const block_type* block) noexcept
+{
+	if (block->release())
+		block_type::dispose(block);
+}
+
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::iterator BucketStorage< T, Instrumentation >::begin() noexcept
+{
+	auto* block = head_block_;
+	while (block && block->getFirst() == npos)
+		block = block->getNext();
+
+	return iterator(this, block, block ? block->getFirst() : 0);
+}
+
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::iterator BucketStorage< T, Instrumentation >::end() noexcept
+{
+	return iterator(this, nullptr, 0, size_);
+}
+
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::const_iterator BucketStorage< T, Instrumentation >::begin() const noexcept
+{
+	auto* block = head_block_;
+	while (block && block->getFirst() == npos)
+		block = block->getNext();
+
+	return const_iterator(this, block, block ? block->getFirst() : 0);
+}
+
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::const_iterator BucketStorage< T, Instrumentation >::end() const noexcept
+{
+	return const_iterator(this, nullptr, 0, size_);
+}
+
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::const_iterator BucketStorage< T, Instrumentation >::cbegin() const noexcept
+{
+	return begin();
+}
+
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::const_iterator BucketStorage< T, Instrumentation >::cend() const noexcept
+{
+	return end();
+}
+
+// Nothing is allocated until the first insert.
+template< typename T, typename Instrumentation >
+BucketStorage< T, Instrumentation >::BucketStorage() noexcept(std::is_nothrow_default_constructible_v< Instrumentation >) :
+	min_block_capacity_(default_block_capacity), max_block_capacity_(default_block_capacity)
+{
+}
+
+template< typename T, typename Instrumentation >
+BucketStorage< T, Instrumentation >::BucketStorage(size_type block_capacity) :
+	BucketStorage(block_capacity, block_capacity)
+{
+}
+
+// Geometric growth: blocks start at min_block_capacity and double up to
+// max_block_capacity (see nextBlockCapacity()).
+template< typename T, typename Instrumentation >
+BucketStorage< T, Instrumentation >::BucketStorage(size_type min_block_capacity, size_type max_block_capacity) :
+	min_block_capacity_(min_block_capacity), max_block_capacity_(max_block_capacity)
+{
+	if (min_block_capacity == 0)
+		throw std::invalid_argument("The block size cannot be equal to 0.");
+	if (max_block_capacity < min_block_capacity)
+		throw std::invalid_argument("The maximum block size cannot be less than the minimum one.");
+}
+
+template< typename T, typename Instrumentation >
+BucketStorage< T, Instrumentation >::BucketStorage(const BucketStorage& other) :
+	reuse_policy_(other.reuse_policy_), min_block_capacity_(other.min_block_capacity_), max_block_capacity_(other.max_block_capacity_),
+	max_size_(other.max_size_), max_bytes_(other.max_bytes_), on_evict_(other.on_evict_), instrumentation_(other.instrumentation_),
+	expiry_(other.expiry_), insert_time_(other.insert_time_)
+{
+	cloneBlocks(other);
+}
+
+template< typename T, typename Instrumentation >
+BucketStorage< T, Instrumentation >::BucketStorage(BucketStorage&& other) noexcept :
+	blocks_(std::move(other.blocks_)), free_block_id_(other.free_block_id_), deleting_(other.deleting_),
+	deleting_mask_(other.deleting_mask_), reuse_policy_(other.reuse_policy_),
+	head_block_(other.head_block_), tail_block_(other.tail_block_), fill_block_(other.fill_block_), size_(other.size_),
+	min_block_capacity_(other.min_block_capacity_), max_block_capacity_(other.max_block_capacity_),
+	capacity_(other.capacity_), block_count_(other.block_count_),
+	block_allocations_(other.block_allocations_), block_frees_(other.block_frees_), block_bytes_(other.block_bytes_),
+	max_size_(other.max_size_), max_bytes_(other.max_bytes_), on_evict_(std::move(other.on_evict_)),
+	instrumentation_(std::move(other.instrumentation_)), expiry_(other.expiry_),
+	insert_time_(other.insert_time_)
+{
+	other.abandon();
+
+	if constexpr (inline_capacity != 0)
+		if (head_block_ && head_block_->isEmbedded())
+			relocateBlock(head_block_, inline_.bytes);
+}
+
+// Forgets every block without freeing it, once another storage owns them.
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::abandon() noexcept
+{
+	blocks_.clear();
+	free_block_id_ = no_block;
+	deleting_.fill(nullptr);
+	deleting_mask_ = 0;
+	head_block_ = nullptr;
+	tail_block_ = nullptr;
+	fill_block_ = nullptr;
+	size_ = 0;
+	capacity_ = 0;
+	block_count_ = 0;
+	block_allocations_ = 0;
+	block_frees_ = 0;
+	block_bytes_ = 0;
+}
+
+template< typename T, typename Instrumentation >
+BucketStorage< T, Instrumentation >& BucketStorage< T, Instrumentation >::operator=(const BucketStorage& other)
+{
+	if (this == &other)
+		return *this;
+
+	BucketStorage< T, Instrumentation > copy(other);
+	adopt(copy);
+
+	return *this;
+}
+
+template< typename T, typename Instrumentation >
+BucketStorage< T, Instrumentation >& BucketStorage< T, Instrumentation >::operator=(BucketStorage&& other) noexcept
+{
+	if (this != &other)
+	{
+		clear();
+		swap(other);
+	}
+	return *this;
+}
+
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::iterator BucketStorage< T, Instrumentation >::insert(const value_type& value)
+{
+	EventScope< Instrumentation > scope(instrumentation_, StorageEvent::Insert);
+	iterator inserted = insertValue(value);
+	traceElement(StorageEvent::Insert, inserted.getCurrentBlock(), inserted.getCurrentIndex());
+
+	return inserted;
+}
+
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::iterator BucketStorage< T, Instrumentation >::insert(value_type&& value)
+{
+	EventScope< Instrumentation > scope(instrumentation_, StorageEvent::Insert);
+	iterator inserted = insertValue(std::move(value));
+	traceElement(StorageEvent::Insert, inserted.getCurrentBlock(), inserted.getCurrentIndex());
+
+	return inserted;
+}
+
+template< typename T, typename Instrumentation >
+template< typename... Args >
+typename BucketStorage< T, Instrumentation >::iterator BucketStorage< T, Instrumentation >::emplace(Args&&... args)
+{
+	EventScope< Instrumentation > scope(instrumentation_, StorageEvent::Insert);
+	iterator inserted = insertValue(std::forward< Args >(args)...);
+	traceElement(StorageEvent::Insert, inserted.getCurrentBlock(), inserted.getCurrentIndex());
+
+	return inserted;
+}
+
+// Evicting may destroy what the arguments refer to, as in insert(*begin())
+// on a full storage, so the value is built before anything is evicted.
+template< typename T, typename Instrumentation >
+template< typename... Args >
+typename BucketStorage< T, Instrumentation >::iterator BucketStorage< T, Instrumentation >::insertValue(Args&&... args)
+{
+	if constexpr (std::is_move_constructible_v< T >)
+		if (evictionDue())
+		{
+			value_type value(std::forward< Args >(args)...);
+			evictForSize();
+			return deleting_mask_ ? insertInDeletedCell(std::move(value)) : insertBody(std::move(value));
+		}
+
+	evictForSize();
+	return deleting_mask_ ? insertInDeletedCell(std::forward< Args >(args)...) : insertBody(std::forward< Args >(args)...);
+}
+
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::iterator BucketStorage< T, Instrumentation >::erase(const_iterator pos)
+{
+	EventScope< Instrumentation > scope(instrumentation_, StorageEvent::Erase);
+	auto* block = detachBlock(pos.getCurrentBlock());
+	size_type index = pos.getCurrentIndex();
+
+	// The following element is found by hand rather than with operator++, so
+	// erasing does not report iteration events of its own.
+	block_type* next_block = block;
+	size_type next_index = block->getElement(index).getNext();
+	if (next_index == npos)
+	{
+		next_block = block->getNext();
+		while (next_block && next_block->getFirst() == npos)
+			next_block = next_block->getNext();
+		next_index = next_block ? next_block->getFirst() : 0;
+	}
+	iterator next(this, next_block, next_index, pos.getCurrentPosition() + 1);
+
+	eraseAt(block, index);
+	return next;
+}
+
+// O(1) erase without an iterator; false if the handle is stale.
+template< typename T, typename Instrumentation >
+bool BucketStorage< T, Instrumentation >::erase(const Handle& handle)
+{
+	block_type* block = findBlock(handle);
+	if (!block)
+		return false;
+
+	EventScope< Instrumentation > scope(instrumentation_, StorageEvent::Erase);
+	eraseAt(detachBlock(block), handle.getSlot());
+	return true;
+}
+
+// Erases a live slot of a block that is not shared.
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::eraseAt(block_type* block, size_type index)
+{
+	traceElement(StorageEvent::Erase, block, index);
+	block->destroy(index);
+	size_--;
+
+	if (block->getSize() == 0 && !block->hasUnusedCells())
+		delBlock(block);
+	else
+		pushDeleting(block);
+}
+
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::iterator BucketStorage< T, Instrumentation >::get_to_distance(iterator iter, const difference_type distance)
+{
+	auto new_iter = iterator(iter);
+
+	if (distance > 0)
+		for (difference_type i = 0; i < distance; ++i)
+			++new_iter;
+	else
+		for (difference_type i = distance; i < 0; ++i)
+			--new_iter;
+
+	return new_iter;
+}
+
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::Handle BucketStorage< T, Instrumentation >::handle(const_iterator pos) const noexcept
+{
+	return makeHandle(pos.getCurrentBlock(), pos.getCurrentIndex());
+}
+
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::Handle BucketStorage< T, Instrumentation >::makeHandle(const block_type* block, size_type slot) const noexcept
+{
+	return Handle(block->getId(), blocks_[block->getId()].epoch, static_cast< std::uint32_t >(slot), block->getElement(slot).getGeneration());
+}
+
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::pointer BucketStorage< T, Instrumentation >::get(const Handle& handle)
+{
+	block_type* block = findBlock(handle);
+	if (!block)
+		return nullptr;
+
+	return &detachBlock(block)->getValue(handle.getSlot());
+}
+
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::const_pointer BucketStorage< T, Instrumentation >::get(const Handle& handle) const noexcept
+{
+	const block_type* block = findBlock(handle);
+	return block ? &block->getValue(handle.getSlot()) : nullptr;
+}
+
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::size_type BucketStorage< T, Instrumentation >::size() const noexcept
+{
+	return size_;
+}
+
+template< typename T, typename Instrumentation >
+bool BucketStorage< T, Instrumentation >::empty() const noexcept
 {
 	return size_ == 0;
 }
 
-template< typename T >
-typename BucketStorage< T >::size_type BucketStorage< T >::capacity() const noexcept
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::size_type BucketStorage< T, Instrumentation >::capacity() const noexcept
 {
-	return size_ ? block_capacity_ * ((current_index_ - 1) / block_capacity_ + 1) : 0;
+	return size_ || fill_block_ ? capacity_ : 0;
 }
 
-template< typename T >
-void BucketStorage< T >::clear() noexcept
+// O(blocks). While the snapshot lives, a dereferenced iterator or get() on
+// the non-const storage copies its block, since the reference it returns may
+// be written through; a read-only pass over a non-const storage therefore
+// copies every block it visits. Read through std::as_const(storage) or a
+// const_iterator to copy only what is really mutated.
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::Snapshot BucketStorage< T, Instrumentation >::snapshot() const
+{
+	static_assert(std::is_copy_constructible_v< T >, "Snapshots need a copyable value_type to detach shared blocks.");
+
+	std::vector< const block_type* > blocks;
+	blocks.reserve(block_count_);
+
+	for (const auto* block = head_block_; block != nullptr; block = block->getNext())
+	{
+		// An embedded block lives in this object, so the snapshot gets a copy.
+		// It is the head, so nothing is retained yet if copying throws.
+		if (block->isEmbedded())
+		{
+			blocks.push_back(block_type::clone(*block));
+			continue;
+		}
+		block->retain();
+		blocks.push_back(block);
+	}
+
+	return Snapshot(std::move(blocks), size_, min_block_capacity_, max_block_capacity_);
+}
+
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::Stats BucketStorage< T, Instrumentation >::stats() const
+{
+	Stats result;
+	result.block_count = block_count_;
+	result.size = size_;
+	result.blocks.reserve(block_count_);
+	result.metadata_bytes = sizeof(*this) + blocks_.capacity() * sizeof(BlockSlot);
+	result.block_allocations = block_allocations_;
+	result.block_frees = block_frees_;
+	result.block_bytes = block_bytes_;
+
+	size_type erased = 0;
+	for (const auto* block = head_block_; block != nullptr; block = block->getNext())
+	{
+		const size_type capacity = block->getBlockCapacity();
+		result.blocks.push_back({ capacity, block->getSize(), block->getDeletedCount() });
+		result.metadata_bytes += sizeof(block_type) + capacity * sizeof(element_type);
+		result.payload_bytes += capacity * sizeof(T);
+		erased += block->getDeletedCount();
+	}
+
+	for (const auto* head : deleting_)
+		for (const auto* block = head; block != nullptr; block = block->getNextDeleting())
+			++result.deleting_blocks;
+
+	if (size_ + erased)
+		result.fragmentation = static_cast< double >(erased) / static_cast< double >(size_ + erased);
+
+	return result;
+}
+
+template< typename T, typename Instrumentation >
+ReusePolicy BucketStorage< T, Instrumentation >::reuse_policy() const noexcept
+{
+	return reuse_policy_;
+}
+
+// Refiles every block with erased slots under the new policy, O(blocks).
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::set_reuse_policy(ReusePolicy policy) noexcept
+{
+	if (policy == reuse_policy_)
+		return;
+
+	reuse_policy_ = policy;
+	deleting_.fill(nullptr);
+	deleting_mask_ = 0;
+
+	for (auto* block = tail_block_; block != nullptr; block = block->getPrevious())
+	{
+		block->setNextDeleting(nullptr);
+		block->setPreviousDeleting(nullptr);
+		if (block->getDeletedCount() != 0)
+			pushDeleting(block);
+	}
+}
+
+// Caps the storage at max_size elements and max_bytes of blocks, 0 for no
+// limit. An insert that would go over a limit first evicts whole blocks
+// from the head, oldest first, calling on_evict for each of their elements.
+// Handles and iterators into evicted blocks become stale. The limits are
+// checked on insert only, so a storage already over them shrinks with the
+// next insert. Either limit has to fit one block, or evicting would throw
+// away the only block to make room.
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::set_bounds(size_type max_size, size_type max_bytes, evict_callback on_evict)
+{
+	const size_type first_capacity = std::max(min_block_capacity_, inline_capacity);
+	if (max_size != 0 && max_size < first_capacity)
+		throw std::invalid_argument("Size limit of BucketStorage is smaller than one block.");
+	if (max_bytes != 0 && max_bytes < block_type::allocationSize(first_capacity))
+		throw std::invalid_argument("Byte limit of BucketStorage is smaller than one block.");
+
+	max_size_ = max_size;
+	max_bytes_ = max_bytes;
+	on_evict_ = std::move(on_evict);
+}
+
+// Starts stamping inserts from steady_clock, which costs a clock read per
+// insert; until then inserts leave the block time ranges alone. Elements
+// already stored count as inserted now. Idempotent.
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::enable_expiry() noexcept
+{
+	startExpiry(std::chrono::steady_clock::now());
+}
+
+template< typename T, typename Instrumentation >
+bool BucketStorage< T, Instrumentation >::expiry_enabled() const noexcept
+{
+	return expiry_;
+}
+
+// The time an insert made now would be stamped with.
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::time_point BucketStorage< T, Instrumentation >::insert_time() const noexcept
 {
-	if (!head_block_ || size_ == 0)
+	return stampTime();
+}
+
+// Enables expiry with a manual clock that stamps the following inserts with
+// now, so callers that insert faster than they need timestamps skip the
+// clock read and advance now from their own clock, as coarsely as their
+// expiry needs.
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::set_insert_time(time_point now) noexcept
+{
+	startExpiry(now);
+	insert_time_ = now;
+}
+
+// Goes back to stamping inserts from steady_clock; expiry stays enabled.
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::reset_insert_time() noexcept
+{
+	insert_time_.reset();
+}
+
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::startExpiry(time_point now) noexcept
+{
+	if (expiry_)
 		return;
+
+	for (auto* block = head_block_; block != nullptr; block = block->getNext())
+		block->setTimes(now, now);
+	expiry_ = true;
+}
+
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::time_point BucketStorage< T, Instrumentation >::stampTime() const noexcept
+{
+	return insert_time_ ? *insert_time_ : std::chrono::steady_clock::now();
+}
+
+// Drops the blocks whose elements were all inserted before time, without
+// looking at the elements. Blocks that straddle time are kept. Throws
+// std::logic_error unless expiry is enabled, as inserts are not stamped.
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::size_type BucketStorage< T, Instrumentation >::expire_older_than(time_point time)
+{
+	return expire_older_than(time, [](const value_type&) { return false; });
+}
+
+// As above, and erases the elements of straddling blocks for which
+// expired(value) is true; only those blocks are checked element by element.
+// Dropped elements go through on_evict of set_bounds() first. Returns the
+// number of elements dropped. O(blocks) plus the straddling blocks.
+template< typename T, typename Instrumentation >
+template< typename Predicate >
+typename BucketStorage< T, Instrumentation >::size_type BucketStorage< T, Instrumentation >::expire_older_than(time_point time, Predicate expired)
+{
+	if (!expiry_)
+		throw std::logic_error("Expiry of BucketStorage is not enabled.");
+
+	const size_type before = size_;
+	auto* block = head_block_;
+	while (block != nullptr)
+	{
+		auto* next = block->getNext();
+		if (block->getSize() != 0 && block->getNewest() < time)
+			evictBlock(block);
+		else if (block->getSize() != 0 && block->getOldest() < time)
+		{
+			for (size_type index = block->getFirst(); index != npos;)
+			{
+				const size_type following = block->getElement(index).getNext();
+				if (expired(std::as_const(block->getValue(index))))
+				{
+					EventScope< Instrumentation > scope(instrumentation_, StorageEvent::Erase);
+					block = detachBlock(block);
+					if (on_evict_)
+						on_evict_(makeHandle(block, index), block->getValue(index));
+					const bool emptied = block->getSize() == 1;
+					eraseAt(block, index);
+					if (emptied)
+						break;
+				}
+				index = following;
+			}
+		}
+		block = next;
+	}
+
+	return before - size_;
+}
+
+template< typename T, typename Instrumentation >
+Instrumentation& BucketStorage< T, Instrumentation >::instrumentation() noexcept
+{
+	return instrumentation_;
+}
+
+template< typename T, typename Instrumentation >
+const Instrumentation& BucketStorage< T, Instrumentation >::instrumentation() const noexcept
+{
+	return instrumentation_;
+}
+
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::clear() noexcept
+{
+	EventScope< Instrumentation > scope(instrumentation_, StorageEvent::Clear);
 	auto* temp = head_block_;
 
 	while (temp != nullptr)
 	{
 		auto temp_next = temp->getNext();
-		delete temp;
+		unregisterBlock(temp);
+		releaseBlock(temp);
 		temp = temp_next;
 	}
 
+	deleting_.fill(nullptr);
+	deleting_mask_ = 0;
 	head_block_ = nullptr;
 	tail_block_ = nullptr;
-	last_object_ = nullptr;
-	first_element_ = nullptr;
+	fill_block_ = nullptr;
 	size_ = 0;
+	block_frees_ += block_count_;
+	capacity_ = 0;
+	block_count_ = 0;
+	block_bytes_ = 0;
 }
 
-template< typename T >
-BucketStorage< T >::~BucketStorage()
+// Destroys every element but keeps the blocks, emptied and in order, so a
+// refill up to the same size allocates nothing and capacity() is unchanged.
+// Blocks still shared with a snapshot are freed instead. Handles and
+// iterators into the storage are invalidated.
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::clear_keep_capacity() noexcept
+{
+	EventScope< Instrumentation > scope(instrumentation_, StorageEvent::Clear);
+	auto* block = head_block_;
+
+	while (block != nullptr)
+	{
+		auto* next = block->getNext();
+		if (block->isShared())
+			dropBlock(block);
+		else
+		{
+			block->reset();
+			block->setNextDeleting(nullptr);
+			block->setPreviousDeleting(nullptr);
+			++blocks_[block->getId()].epoch;
+		}
+		block = next;
+	}
+
+	deleting_.fill(nullptr);
+	deleting_mask_ = 0;
+	fill_block_ = head_block_;
+	size_ = 0;
+}
+
+template< typename T, typename Instrumentation >
+BucketStorage< T, Instrumentation >::~BucketStorage()
 {
 	clear();
 }
 
-template< typename T >
-void BucketStorage< T >::shrink_to_fit()
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::shrink_to_fit()
 {
-	BucketStorage< T > new_storage(block_capacity_);
-	iterator iter = begin();
-	iterator end_ = end();
+	EventScope< Instrumentation > scope(instrumentation_, StorageEvent::ShrinkToFit);
+	BucketStorage< T, Instrumentation > new_storage(min_block_capacity_, max_block_capacity_);
+	new_storage.reuse_policy_ = reuse_policy_;
 
-	while (iter != end_)
+	// Moved elements keep the time range of their source block.
+	for (auto* block = head_block_; block != nullptr; block = block->getNext())
 	{
-		if (iter.getCurrentElement()->isActive() && iter.getCurrentElement()->getValue())
-			new_storage.insert(std::move(*iter.getCurrentElement()->getValue()));
-		++iter;
+		const bool shared = block->isShared();
+		for (size_type index = block->getFirst(); index != npos; index = block->getElement(index).getNext())
+		{
+			if constexpr (std::is_copy_constructible_v< T >)
+			{
+				if (shared)
+				{
+					iterator moved = new_storage.insert(std::as_const(block->getValue(index)));
+					moved.getCurrentBlock()->stamp(block->getOldest(), block->getNewest());
+					traceElement(StorageEvent::ShrinkToFit, moved.getCurrentBlock(), moved.getCurrentIndex(), location(block, index));
+					continue;
+				}
+			}
+			iterator moved = new_storage.insert(std::move(block->getValue(index)));
+			moved.getCurrentBlock()->stamp(block->getOldest(), block->getNewest());
+			traceElement(StorageEvent::ShrinkToFit, moved.getCurrentBlock(), moved.getCurrentIndex(), location(block, index));
+		}
 	}
 
-	swap(new_storage);
+	// Limits are only handed over now, so the rebuild never evicts.
+	new_storage.max_size_ = max_size_;
+	new_storage.max_bytes_ = max_bytes_;
+	new_storage.on_evict_.swap(on_evict_);
+	adopt(new_storage);
 }
 
-template< typename T >
-void BucketStorage< T >::swap(BucketStorage& other) noexcept
+// Moves up to budget elements out of the sparsest blocks into holes of the
+// others, as picked by the reuse policy, and frees each block it drains.
+// Every move is reported as on_move(old Handle, new Handle); the old handle
+// and iterators to moved elements are stale afterwards. Returns the number
+// of moves, less than budget once no block can be drained any further.
+template< typename T, typename Instrumentation >
+template< typename Callback >
+typename BucketStorage< T, Instrumentation >::size_type BucketStorage< T, Instrumentation >::compact_step(size_type budget, Callback&& on_move)
+{
+	EventScope< Instrumentation > scope(instrumentation_, StorageEvent::Compact);
+	size_type moved = 0;
+
+	while (moved < budget)
+	{
+		block_type* source = sparsestBlock();
+		if (!source)
+			break;
+
+		source = detachBlock(source);
+		popDeleting(source);
+
+		try
+		{
+			while (moved < budget && source->getSize() != 0 && reuseBlock())
+			{
+				block_type* target = detachBlock(reuseBlock());
+				const size_type index = source->getFirst();
+				const Handle from = makeHandle(source, index);
+
+				const size_type slot = target->emplace(std::move(source->getValue(index)));
+				target->stamp(source->getOldest(), source->getNewest());
+				source->destroy(index);
+
+				if (target->getDeletedCount() == 0)
+					popDeleting(target);
+				else
+					pushDeleting(target);
+
+				traceElement(StorageEvent::Relocate, target, slot, location(source, index));
+				++moved;
+				on_move(from, makeHandle(target, slot));
+			}
+		} catch (...)
+		{
+			pushDeleting(source);
+			throw;
+		}
+
+		if (source->getSize() == 0)
+			delBlock(source);
+		else
+		{
+			pushDeleting(source);
+			break;
+		}
+	}
+
+	return moved;
+}
+
+// A block with many holes, or nullptr unless the holes of the other blocks
+// can take all of its elements. Candidates come from the highest non-empty
+// deleting buckets (most holes under FullestBlockFirst; the block erased from
+// last under Lifo), and only the first few are compared, so a step does not
+// walk every block. The tail is skipped while it has unused cells, as
+// emptying it would not free it.
+template< typename T, typename Instrumentation >
+typename BucketStorage< T, Instrumentation >::block_type* BucketStorage< T, Instrumentation >::sparsestBlock() const noexcept
 {
+	constexpr size_type candidates = 4;
+
+	block_type* sparsest = nullptr;
+	size_type seen = 0;
+	for (std::uint32_t mask = deleting_mask_; mask != 0 && seen < candidates;)
+	{
+		const auto bucket = static_cast< std::uint32_t >(std::bit_width(mask)) - 1;
+		mask &= ~(1u << bucket);
+
+		for (auto* block = deleting_[bucket]; block != nullptr && seen < candidates; block = block->getNextDeleting())
+		{
+			++seen;
+			if (!block->hasUnusedCells() && (!sparsest || block->getSize() < sparsest->getSize()))
+				sparsest = block;
+		}
+	}
+
+	// Free cells bound the holes from above, which rules most refusals out
+	// without a walk; otherwise the walk stops once enough holes are found.
+	if (!sparsest || capacity_ - size_ - sparsest->getDeletedCount() < sparsest->getSize())
+		return nullptr;
+
+	size_type holes = 0;
+	for (std::uint32_t mask = deleting_mask_; mask != 0 && holes < sparsest->getSize();)
+	{
+		const auto bucket = static_cast< std::uint32_t >(std::countr_zero(mask));
+		mask &= mask - 1;
+
+		for (auto* block = deleting_[bucket]; block != nullptr && holes < sparsest->getSize(); block = block->getNextDeleting())
+			if (block != sparsest)
+				holes += block->getDeletedCount();
+	}
+
+	return holes < sparsest->getSize() ? nullptr : sparsest;
+}
+
+// Appends the blocks of other behind the tail without moving any element,
+// and leaves other empty. Blocks keep their capacities, so the capacity
+// bounds widen to cover those of other. O(blocks of other): each block gets
+// an id here, so handles and iterators into other are invalidated.
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::merge(BucketStorage&& other)
+{
+	if (this == &other || !other.head_block_)
+		return;
+
+	if (blocks_.size() + other.block_count_ > no_block)
+		throw std::length_error("Too many blocks in BucketStorage.");
+	blocks_.reserve(blocks_.size() + other.block_count_);
+
+	if constexpr (inline_capacity != 0)
+		if (other.head_block_->isEmbedded())
+			other.relocateBlock(other.head_block_, head_block_ ? nullptr : inlineMemory());
+
+	// The tail of this storage ends up in the middle of the chain, so the
+	// fill cursor has to pass through it before the new tail.
+	if (!fill_block_ && tail_block_ && tail_block_->hasUnusedCells())
+		fill_block_ = tail_block_;
+	else if (!fill_block_)
+		fill_block_ = other.fill_block_;
+
+	for (auto* block = other.head_block_; block != nullptr; block = block->getNext())
+	{
+		registerBlock(block);
+		block->setNextDeleting(nullptr);
+		block->setPreviousDeleting(nullptr);
+		if (block->getDeletedCount() != 0)
+			pushDeleting(block);
+	}
+
+	other.head_block_->setPrevious(tail_block_);
+	if (tail_block_)
+		tail_block_->setNext(other.head_block_);
+	else
+		head_block_ = other.head_block_;
+	tail_block_ = other.tail_block_;
+
+	size_ += other.size_;
+	capacity_ += other.capacity_;
+	block_bytes_ += other.block_bytes_;
+	block_count_ += other.block_count_;
+	block_allocations_ += other.block_allocations_;
+	block_frees_ += other.block_frees_;
+	min_block_capacity_ = std::min(min_block_capacity_, other.min_block_capacity_);
+	max_block_capacity_ = std::max(max_block_capacity_, other.max_block_capacity_);
+	other.abandon();
+}
+
+// Moves the blocks at positions [first, last) of the chain, with their
+// elements, into a new storage with the same settings. O(last) and no
+// element is moved; handles into those blocks are invalidated.
+template< typename T, typename Instrumentation >
+BucketStorage< T, Instrumentation > BucketStorage< T, Instrumentation >::extract_blocks(size_type first, size_type last)
+{
+	if (first > last || last > block_count_)
+		throw std::out_of_range("Block range out of BucketStorage.");
+
+	BucketStorage< T, Instrumentation > extracted(min_block_capacity_, max_block_capacity_);
+	extracted.reuse_policy_ = reuse_policy_;
+	extracted.expiry_ = expiry_;
+	extracted.insert_time_ = insert_time_;
+
+	auto* block = head_block_;
+	for (size_type position = 0; position < first; ++position)
+		block = block->getNext();
+
+	for (size_type position = first; position < last; ++position)
+	{
+		auto* next = block->getNext();
+		handOver(block, extracted);
+		block = next;
+	}
+
+	return extracted;
+}
+
+// Hands all blocks out to parts storages of consecutive blocks, balanced by
+// live elements; this storage is left empty. O(blocks).
+template< typename T, typename Instrumentation >
+std::vector< BucketStorage< T, Instrumentation > > BucketStorage< T, Instrumentation >::split(size_type parts)
+{
+	if (parts == 0)
+		throw std::invalid_argument("Cannot split a BucketStorage into 0 parts.");
+
+	std::vector< size_type > counts(parts, 0);
+	size_type part = 0;
+	size_type seen = 0;
+	for (const auto* block = head_block_; block != nullptr; block = block->getNext())
+	{
+		// A block goes to the next part once its middle is past this one's share.
+		while (part + 1 < parts && counts[part] != 0 && seen + block->getSize() / 2 >= size_ * (part + 1) / parts)
+			++part;
+		++counts[part];
+		seen += block->getSize();
+	}
+
+	std::vector< BucketStorage< T, Instrumentation > > result;
+	result.reserve(parts);
+	for (const size_type count : counts)
+		result.push_back(extract_blocks(0, count));
+
+	return result;
+}
+
+// Moves the elements matching pred into a new storage with the same
+// settings. Blocks that match as a whole move without touching their
+// elements; only mixed blocks move matching elements one by one.
+template< typename T, typename Instrumentation >
+template< typename Predicate >
+BucketStorage< T, Instrumentation > BucketStorage< T, Instrumentation >::partition(Predicate pred)
+{
+	BucketStorage< T, Instrumentation > matching(min_block_capacity_, max_block_capacity_);
+	matching.reuse_policy_ = reuse_policy_;
+
+	std::vector< size_type > matches;
+	auto* block = head_block_;
+	while (block != nullptr)
+	{
+		auto* next = block->getNext();
+		matches.clear();
+		for (size_type index = block->getFirst(); index != npos; index = block->getElement(index).getNext())
+			if (pred(std::as_const(block->getValue(index))))
+				matches.push_back(index);
+
+		if (!matches.empty() && matches.size() == block->getSize())
+			handOver(block, matching);
+		else if (!matches.empty())
+		{
+			block = detachBlock(block);
+			for (const size_type index : matches)
+			{
+				iterator moved = matching.insert(std::move(block->getValue(index)));
+				moved.getCurrentBlock()->stamp(block->getOldest(), block->getNewest());
+				erase(iterator(this, block, index));
+			}
+		}
+		block = next;
+	}
+
+	matching.expiry_ = expiry_;
+	matching.insert_time_ = insert_time_;
+	return matching;
+}
+
+template< typename T, typename Instrumentation >
+void BucketStorage< T, Instrumentation >::swap(BucketStorage& other) noexcept
+{
+	// Embedded blocks trade places through a spare slot before the pointers
+	// are swapped.
+	if constexpr (inline_capacity != 0)
+	{
+		InlineBlock spare;
+		block_type* mine = head_block_ && head_block_->isEmbedded() ? relocateBlock(head_block_, spare.bytes) : nullptr;
+		if (other.head_block_ && other.head_block_->isEmbedded())
+			other.relocateBlock(other.head_block_, inline_.bytes);
+		if (mine)
+			relocateBlock(mine, other.inline_.bytes);
+	}
+
+	blocks_.swap(other.blocks_);
+	std::swap(free_block_id_, other.free_block_id_);
+	deleting_.swap(other.deleting_);
+	std::swap(deleting_mask_, other.deleting_mask_);
+	std::swap(reuse_policy_, other.reuse_policy_);
 	std::swap(head_block_, other.head_block_);
 	std::swap(tail_block_, other.tail_block_);
-	std::swap(last_object_, other.last_object_);
+	std::swap(fill_block_, other.fill_block_);
 	std::swap(size_, other.size_);
-	std::swap(block_capacity_, other.block_capacity_);
-	std::swap(current_index_, other.current_index_);
-	std::swap(first_element_, other.first_element_);
+	std::swap(min_block_capacity_, other.min_block_capacity_);
+	std::swap(max_block_capacity_, other.max_block_capacity_);
+	std::swap(capacity_, other.capacity_);
+	std::swap(block_count_, other.block_count_);
+	std::swap(block_allocations_, other.block_allocations_);
+	std::swap(block_frees_, other.block_frees_);
+	std::swap(block_bytes_, other.block_bytes_);
+	std::swap(max_size_, other.max_size_);
+	std::swap(max_bytes_, other.max_bytes_);
+	on_evict_.swap(other.on_evict_);
+}
+
+template< typename T, typename Instrumentation >
+template< typename U >
+void BucketStorage< T, Instrumentation >::writeValue(std::ostream& out, const U& value)
+{
+	out.write(reinterpret_cast< const char* >(&value), sizeof(U));
+}
+
+template< typename T, typename Instrumentation >
+template< typename U >
+U BucketStorage< T, Instrumentation >::readValue(std::istream& in)
+{
+	U value{};
+	if (!in.read(reinterpret_cast< char* >(&value), sizeof(U)))
+		throw std::runtime_error("Unexpected end of BucketStorage dump.");
+	return value;
+}
+
+template< typename T, typename Instrumentation >
+template< typename Serializer >
+void BucketStorage< T, Instrumentation >::writeBlock(std::ostream& out, const block_type& block, Serializer& serializer)
+{
+	const size_type used = block.getUsed();
+	writeValue(out, static_cast< std::uint64_t >(block.getBlockCapacity()));
+	writeValue(out, static_cast< std::uint64_t >(used));
+
+	std::vector< unsigned char > mask((used + 7) / 8);
+	for (size_type index = 0; index < used; ++index)
+		if (block.getElement(index).isActive())
+			mask[index / 8] |= static_cast< unsigned char >(1u << (index % 8));
+	out.write(reinterpret_cast< const char* >(mask.data()), static_cast< std::streamsize >(mask.size()));
+
+	if constexpr (std::is_same_v< Serializer, RawSerializer >)
+		out.write(reinterpret_cast< const char* >(block.getValues()), static_cast< std::streamsize >(used * sizeof(T)));
+	else
+		for (size_type index = 0; index < used; ++index)
+			if (block.getElement(index).isActive())
+				serializer(out, std::as_const(block.getValue(index)));
+}
+
+template< typename T, typename Instrumentation >
+template< typename Deserializer >
+void BucketStorage< T, Instrumentation >::readBlock(std::istream& in, Deserializer& deserializer)
+{
+	const auto capacity = static_cast< size_type >(readValue< std::uint64_t >(in));
+	const auto used = static_cast< size_type >(readValue< std::uint64_t >(in));
+	// Blocks the size of the embedded one may come out of it through merge().
+	const bool inline_sized = inline_capacity != 0 && capacity == inline_capacity;
+	if ((!inline_sized && (capacity < min_block_capacity_ || capacity > max_block_capacity_)) || used > capacity)
+		throw std::runtime_error("Corrupted BucketStorage dump: bad block header.");
+
+	std::vector< unsigned char > mask((used + 7) / 8);
+	if (!in.read(reinterpret_cast< char* >(mask.data()), static_cast< std::streamsize >(mask.size())))
+		throw std::runtime_error("Unexpected end of BucketStorage dump.");
+
+	auto* block = block_type::create(capacity, inline_sized && block_count_ == 0 ? inlineMemory() : nullptr);
+	linkBlock(block);
+
+	if constexpr (std::is_same_v< Deserializer, RawSerializer >)
+	{
+		if (!in.read(reinterpret_cast< char* >(block->getValues()), static_cast< std::streamsize >(used * sizeof(T))))
+			throw std::runtime_error("Unexpected end of BucketStorage dump.");
+	}
+
+	for (size_type index = 0; index < used; ++index)
+	{
+		const bool is_active = mask[index / 8] & (1u << (index % 8));
+		if constexpr (!std::is_same_v< Deserializer, RawSerializer >)
+		{
+			if (is_active)
+				::new (static_cast< void* >(block->getValues() + index)) T(deserializer(in));
+		}
+		block->restoreCell(is_active);
+	}
+
+	size_ += block->getSize();
+	if (block->getDeletedCount() > 0)
+		pushDeleting(block);
+}
+
+// Dump layout (native byte order, meant to be read back by the same build):
+// header {magic, version, raw flag, sizeof(T), block capacity, size, block
+// count}, then per block {capacity, used slots, occupancy bitmask of the used
+// slots, payload}. The raw payload is the whole used part of the block.
+template< typename T, typename Instrumentation >
+template< typename Serializer >
+void BucketStorage< T, Instrumentation >::writeHeader(std::ostream& out, size_type min_block_capacity, size_type max_block_capacity, size_type size, size_type block_count)
+{
+	constexpr bool raw = std::is_same_v< Serializer, RawSerializer >;
+	if constexpr (raw)
+		static_assert(std::is_trivially_copyable_v< T >, "RawSerializer needs a trivially copyable value_type.");
+
+	writeValue(out, dump_magic);
+	writeValue(out, dump_version);
+	writeValue(out, static_cast< std::uint32_t >(raw));
+	writeValue(out, static_cast< std::uint64_t >(sizeof(T)));
+	writeValue(out, static_cast< std::uint64_t >(min_block_capacity));
+	writeValue(out, static_cast< std::uint64_t >(max_block_capacity));
+	writeValue(out, static_cast< std::uint64_t >(size));
+	writeValue(out, static_cast< std::uint64_t >(block_count));
+}
+
+template< typename T, typename Instrumentation >
+template< typename Serializer >
+void BucketStorage< T, Instrumentation >::save(std::ostream& out, Serializer serializer) const
+{
+	writeHeader< Serializer >(out, min_block_capacity_, max_block_capacity_, size_, block_count_);
+
+	for (const auto* block = head_block_; block != nullptr; block = block->getNext())
+		writeBlock(out, *block, serializer);
+
+	if (!out)
+		throw std::runtime_error("Cannot write BucketStorage dump.");
+}
+
+template< typename T, typename Instrumentation >
+template< typename Serializer >
+void BucketStorage< T, Instrumentation >::save(const std::string& path, Serializer serializer) const
+{
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	if (!out)
+		throw std::runtime_error("Cannot open " + path + " for writing.");
+
+	save(out, std::move(serializer));
+}
+
+template< typename T, typename Instrumentation >
+template< typename Deserializer >
+void BucketStorage< T, Instrumentation >::load(std::istream& in, Deserializer deserializer)
+{
+	constexpr bool raw = std::is_same_v< Deserializer, RawSerializer >;
+	if constexpr (raw)
+		static_assert(std::is_trivially_copyable_v< T >, "RawSerializer needs a trivially copyable value_type.");
+
+	if (readValue< std::uint32_t >(in) != dump_magic)
+		throw std::runtime_error("Not a BucketStorage dump.");
+	const auto version = readValue< std::uint32_t >(in);
+	if (version == 0 || version > dump_version)
+		throw std::runtime_error("Not a BucketStorage dump.");
+	if (readValue< std::uint32_t >(in) != static_cast< std::uint32_t >(raw) || readValue< std::uint64_t >(in) != sizeof(T))
+		throw std::runtime_error("BucketStorage dump was written for another value_type or serializer.");
+
+	// Version 1 dumps had a single fixed block capacity.
+	const auto min_block_capacity = static_cast< size_type >(readValue< std::uint64_t >(in));
+	const auto max_block_capacity = version == 1 ? min_block_capacity : static_cast< size_type >(readValue< std::uint64_t >(in));
+	const auto size = static_cast< size_type >(readValue< std::uint64_t >(in));
+	const auto block_count = static_cast< size_type >(readValue< std::uint64_t >(in));
+
+	BucketStorage< T, Instrumentation > loaded(min_block_capacity, max_block_capacity);
+	loaded.reuse_policy_ = reuse_policy_;
+
+	for (size_type i = 0; i < block_count; ++i)
+		loaded.readBlock(in, deserializer);
+
+	if (loaded.size_ != size)
+		throw std::runtime_error("Corrupted BucketStorage dump: size mismatch.");
+
+	// Blocks kept by clear_keep_capacity() are refilled before the tail.
+	for (auto* block = loaded.head_block_; block != loaded.tail_block_ && !loaded.fill_block_; block = block->getNext())
+		if (block->hasUnusedCells())
+			loaded.fill_block_ = block;
+
+	// Dumps carry no insertion times: loaded elements count as inserted now.
+	if (expiry_)
+	{
+		const time_point now = stampTime();
+		for (auto* block = loaded.head_block_; block != nullptr; block = block->getNext())
+			block->setTimes(now, now);
+	}
+
+	loaded.max_size_ = max_size_;
+	loaded.max_bytes_ = max_bytes_;
+	loaded.on_evict_.swap(on_evict_);
+	adopt(loaded);
+}
+
+template< typename T, typename Instrumentation >
+template< typename Deserializer >
+void BucketStorage< T, Instrumentation >::load(const std::string& path, Deserializer deserializer)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in)
+		throw std::runtime_error("Cannot open " + path + " for reading.");
+
+	load(in, std::move(deserializer));
+}
+
+// Takes a snapshot (O(blocks)) and writes it from a background thread while
+// the storage keeps accepting inserts and erases; blocks mutated meanwhile
+// are copied on write. The dump goes to path + ".tmp" and is renamed over
+// path once complete, so path always holds a whole checkpoint. The returned
+// future reports errors and waits for the writer thread when destroyed.
+// Until then the copy-on-write rules of snapshot() apply: read through
+// std::as_const(storage) so that reads do not copy blocks.
+template< typename T, typename Instrumentation >
+template< typename Serializer >
+std::future< void > BucketStorage< T, Instrumentation >::checkpoint_async(const std::string& path, Serializer serializer) const
+{
+	return std::async(
+		std::launch::async,
+		[snapshot = snapshot(), path, serializer = std::move(serializer)]() mutable
+		{
+			const std::string temporary = path + ".tmp";
+			snapshot.save(temporary, std::move(serializer));
+
+			if (std::rename(temporary.c_str(), path.c_str()) != 0)
+				throw std::runtime_error("Cannot move checkpoint to " + path + ".");
+		});
 }
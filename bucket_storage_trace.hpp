@@ -0,0 +1,319 @@
+#pragma once
+
+#include "bucket_storage.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+enum class TraceOp : std::uint8_t
+{
+	Insert,
+	Erase,
+	Iterate,
+	Clear,
+	ShrinkToFit
+};
+
+// Compact binary workload trace: one opcode byte per operation, and an
+// erase is followed by the LEB128 id of its element. Elements are numbered
+// by insertion order from 0, so the values themselves are not recorded.
+class Trace
+{
+  public:
+	using size_type = std::size_t;
+
+	struct Record
+	{
+		TraceOp op{ TraceOp::Insert };
+		std::uint64_t id{ 0 };
+	};
+
+  private:
+	static constexpr std::uint32_t trace_magic = 0x5254534B;
+	static constexpr std::uint32_t trace_version = 1;
+
+	std::vector< unsigned char > bytes_;
+	std::uint64_t insert_count_{ 0 };
+
+  public:
+	void append(TraceOp op);
+	void appendErase(std::uint64_t id);
+	void clear() noexcept;
+
+	[[nodiscard]] std::vector< Record > decode() const;
+	[[nodiscard]] size_type size() const noexcept;
+	[[nodiscard]] std::uint64_t getInsertCount() const noexcept;
+
+	void save(std::ostream& out) const;
+	void save(const std::string& path) const;
+	void load(std::istream& in);
+	void load(const std::string& path);
+};
+
+inline void Trace::append(TraceOp op)
+{
+	bytes_.push_back(static_cast< unsigned char >(op));
+	if (op == TraceOp::Insert)
+		++insert_count_;
+}
+
+inline void Trace::appendErase(std::uint64_t id)
+{
+	bytes_.push_back(static_cast< unsigned char >(TraceOp::Erase));
+	do
+	{
+		bytes_.push_back(static_cast< unsigned char >((id & 0x7F) | (id > 0x7F ? 0x80 : 0)));
+		id >>= 7;
+	} while (id != 0);
+}
+
+inline void Trace::clear() noexcept
+{
+	bytes_.clear();
+	insert_count_ = 0;
+}
+
+inline std::vector< Trace::Record > Trace::decode() const
+{
+	std::vector< Record > records;
+	records.reserve(bytes_.size());
+
+	for (size_type position = 0; position < bytes_.size();)
+	{
+		Record record{ static_cast< TraceOp >(bytes_[position++]), 0 };
+		if (record.op > TraceOp::ShrinkToFit)
+			throw std::runtime_error("Corrupted trace: unknown operation.");
+
+		if (record.op == TraceOp::Erase)
+		{
+			unsigned shift = 0;
+			unsigned char byte = 0x80;
+			while (byte & 0x80)
+			{
+				if (position == bytes_.size() || shift > 63)
+					throw std::runtime_error("Corrupted trace: truncated element id.");
+				byte = bytes_[position++];
+				record.id |= static_cast< std::uint64_t >(byte & 0x7F) << shift;
+				shift += 7;
+			}
+		}
+		records.push_back(record);
+	}
+
+	return records;
+}
+
+inline Trace::size_type Trace::size() const noexcept
+{
+	return bytes_.size();
+}
+
+inline std::uint64_t Trace::getInsertCount() const noexcept
+{
+	return insert_count_;
+}
+
+inline void Trace::save(std::ostream& out) const
+{
+	const std::uint32_t header[] = { trace_magic, trace_version };
+	const std::uint64_t counts[] = { insert_count_, bytes_.size() };
+	out.write(reinterpret_cast< const char* >(header), sizeof(header));
+	out.write(reinterpret_cast< const char* >(counts), sizeof(counts));
+	out.write(reinterpret_cast< const char* >(bytes_.data()), static_cast< std::streamsize >(bytes_.size()));
+
+	if (!out)
+		throw std::runtime_error("Cannot write trace.");
+}
+
+inline void Trace::save(const std::string& path) const
+{
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	if (!out)
+		throw std::runtime_error("Cannot open " + path + " for writing.");
+
+	save(out);
+}
+
+inline void Trace::load(std::istream& in)
+{
+	std::uint32_t header[2] = {};
+	std::uint64_t counts[2] = {};
+	if (!in.read(reinterpret_cast< char* >(header), sizeof(header)) || header[0] != trace_magic || header[1] != trace_version)
+		throw std::runtime_error("Not a BucketStorage trace.");
+	if (!in.read(reinterpret_cast< char* >(counts), sizeof(counts)))
+		throw std::runtime_error("Unexpected end of trace.");
+
+	std::vector< unsigned char > bytes(static_cast< size_type >(counts[1]));
+	if (!in.read(reinterpret_cast< char* >(bytes.data()), static_cast< std::streamsize >(bytes.size())))
+		throw std::runtime_error("Unexpected end of trace.");
+
+	bytes_ = std::move(bytes);
+	insert_count_ = counts[0];
+}
+
+inline void Trace::load(const std::string& path)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in)
+		throw std::runtime_error("Cannot open " + path + " for reading.");
+
+	load(in);
+}
+
+// Instrumentation policy that records a Trace of the storage it is plugged
+// into (BucketStorage< T, TraceRecorder >) on top of the usual counters.
+// Elements inserted before recording started are not in the trace, and
+// erasing them is skipped.
+class TraceRecorder : public CountingInstrumentation
+{
+  private:
+	Trace trace_;
+	std::unordered_map< std::uint64_t, std::uint64_t > ids_;
+	std::unordered_map< std::uint64_t, std::uint64_t > relocated_;
+	std::uint64_t next_id_{ 0 };
+
+  public:
+	void record(StorageEvent event, std::chrono::nanoseconds elapsed);
+	void trace(StorageEvent event, std::uint64_t location, std::uint64_t previous);
+
+	const Trace& getTrace() const noexcept;
+	void reset() noexcept;
+};
+
+inline void TraceRecorder::record(StorageEvent event, std::chrono::nanoseconds elapsed)
+{
+	CountingInstrumentation::record(event, elapsed);
+
+	switch (event)
+	{
+	case StorageEvent::Iterate:
+		trace_.append(TraceOp::Iterate);
+		break;
+	case StorageEvent::Clear:
+		ids_.clear();
+		trace_.append(TraceOp::Clear);
+		break;
+	case StorageEvent::ShrinkToFit:
+		ids_.swap(relocated_);
+		relocated_.clear();
+		trace_.append(TraceOp::ShrinkToFit);
+		break;
+	default:
+		break;
+	}
+}
+
+inline void TraceRecorder::trace(StorageEvent event, std::uint64_t location, std::uint64_t previous)
+{
+	if (event == StorageEvent::Insert)
+	{
+		ids_[location] = next_id_++;
+		trace_.append(TraceOp::Insert);
+		return;
+	}
+
+	const bool moved = event == StorageEvent::ShrinkToFit || event == StorageEvent::Relocate;
+	const auto found = ids_.find(moved ? previous : location);
+	if (found == ids_.end())
+		return;
+
+	if (event == StorageEvent::ShrinkToFit)
+		relocated_[location] = found->second;
+	else if (event == StorageEvent::Relocate)
+	{
+		const std::uint64_t id = found->second;
+		ids_.erase(found);
+		ids_[location] = id;
+	}
+	else if (event == StorageEvent::Erase)
+	{
+		trace_.appendErase(found->second);
+		ids_.erase(found);
+	}
+}
+
+inline const Trace& TraceRecorder::getTrace() const noexcept
+{
+	return trace_;
+}
+
+inline void TraceRecorder::reset() noexcept
+{
+	CountingInstrumentation::reset();
+	trace_.clear();
+	ids_.clear();
+	relocated_.clear();
+	next_id_ = 0;
+}
+
+struct ReplayResult
+{
+	std::size_t operations{ 0 };
+	std::chrono::nanoseconds elapsed{ 0 };
+	std::size_t peak_capacity{ 0 };
+	std::uint64_t checksum{ 0 };
+};
+
+// Runs a trace against storage. Its value_type is built from the element id
+// and converts back to it, which is how elements are found again after
+// shrink_to_fit. Only the storage operations are timed, not the rebuild
+// of the id map after a shrink_to_fit.
+template< typename Storage >
+ReplayResult replay(const Trace& trace, Storage& storage)
+{
+	using iterator = typename Storage::iterator;
+	using value_type = typename Storage::value_type;
+
+	const std::vector< Trace::Record > records = trace.decode();
+	std::vector< iterator > elements;
+	elements.reserve(static_cast< std::size_t >(trace.getInsertCount()));
+
+	ReplayResult result;
+	result.operations = records.size();
+	std::uint64_t next_id = 0;
+
+	auto start = std::chrono::steady_clock::now();
+	for (const Trace::Record& record : records)
+	{
+		switch (record.op)
+		{
+		case TraceOp::Insert:
+			elements.push_back(storage.insert(value_type(next_id++)));
+			result.peak_capacity = std::max(result.peak_capacity, storage.capacity());
+			break;
+		case TraceOp::Erase:
+			if (record.id >= elements.size())
+				throw std::runtime_error("Corrupted trace: erase of an element that was never inserted.");
+			storage.erase(elements[static_cast< std::size_t >(record.id)]);
+			break;
+		case TraceOp::Iterate:
+			for (const value_type& value : std::as_const(storage))
+				result.checksum += static_cast< std::uint64_t >(value);
+			break;
+		case TraceOp::Clear:
+			storage.clear();
+			break;
+		case TraceOp::ShrinkToFit:
+		{
+			storage.shrink_to_fit();
+			const auto paused = std::chrono::steady_clock::now();
+			for (iterator it = storage.begin(); it != storage.end(); ++it)
+				elements[static_cast< std::size_t >(static_cast< std::uint64_t >(*typename Storage::const_iterator(it)))] = it;
+			start += std::chrono::steady_clock::now() - paused;
+			break;
+		}
+		}
+	}
+	result.elapsed = std::chrono::duration_cast< std::chrono::nanoseconds >(std::chrono::steady_clock::now() - start);
+
+	return result;
+}
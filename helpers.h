@@ -1,6 +1,9 @@
 #include "bucket_storage.hpp"
 
+#include <atomic>
+#include <cstdlib>
 #include <exception>
+#include <new>
 #include <ostream>
 #include <string>
 #include <variant>
@@ -58,6 +61,90 @@ class OpCount
 OpCount opCount;
 const OpCount NO_OP = OpCount(0, 0, 0, 0, 0, 0);
 
+// Counts every heap allocation of the test binary through the replaced
+// global operator new/delete below.
+class AllocCount
+{
+  public:
+	std::atomic< size_t > allocations = 0;
+	std::atomic< size_t > deallocations = 0;
+	void clearCounters()
+	{
+		allocations = 0;
+		deallocations = 0;
+	}
+};
+
+AllocCount allocCount;
+
+void *countedAllocate(std::size_t size, std::size_t alignment)
+{
+	allocCount.allocations++;
+	void *memory = alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__
+					   ? std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment)
+					   : std::malloc(size ? size : 1);
+	if (!memory)
+		throw std::bad_alloc();
+	return memory;
+}
+
+void countedDeallocate(void *memory) noexcept
+{
+	if (!memory)
+		return;
+	allocCount.deallocations++;
+	std::free(memory);
+}
+
+void *operator new(std::size_t size)
+{
+	return countedAllocate(size, 0);
+}
+void *operator new[](std::size_t size)
+{
+	return countedAllocate(size, 0);
+}
+void *operator new(std::size_t size, std::align_val_t alignment)
+{
+	return countedAllocate(size, static_cast< std::size_t >(alignment));
+}
+void *operator new[](std::size_t size, std::align_val_t alignment)
+{
+	return countedAllocate(size, static_cast< std::size_t >(alignment));
+}
+void operator delete(void *memory) noexcept
+{
+	countedDeallocate(memory);
+}
+void operator delete[](void *memory) noexcept
+{
+	countedDeallocate(memory);
+}
+void operator delete(void *memory, std::size_t) noexcept
+{
+	countedDeallocate(memory);
+}
+void operator delete[](void *memory, std::size_t) noexcept
+{
+	countedDeallocate(memory);
+}
+void operator delete(void *memory, std::align_val_t) noexcept
+{
+	countedDeallocate(memory);
+}
+void operator delete[](void *memory, std::align_val_t) noexcept
+{
+	countedDeallocate(memory);
+}
+void operator delete(void *memory, std::size_t, std::align_val_t) noexcept
+{
+	countedDeallocate(memory);
+}
+void operator delete[](void *memory, std::size_t, std::align_val_t) noexcept
+{
+	countedDeallocate(memory);
+}
+
 class CountedOperationObject
 {
   public:
@@ -0,0 +1,1154 @@
+#pragma once
+
+#include "bucket_storage.hpp"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+// Owns a file descriptor and a shared read-write mapping of the whole file.
+// pin() maps the start of the file a second time, at an address that stays
+// put when the whole mapping moves.
+class MappedRegion
+{
+  private:
+	int fd_{ -1 };
+	unsigned char* data_{ nullptr };
+	std::size_t size_{ 0 };
+	unsigned char* pinned_{ nullptr };
+	std::size_t pinned_size_{ 0 };
+
+	void map(std::size_t size);
+	void unmap() noexcept;
+
+  public:
+	MappedRegion() noexcept = default;
+	explicit MappedRegion(int fd);
+	MappedRegion(MappedRegion&& other) noexcept;
+	MappedRegion& operator=(MappedRegion&& other) noexcept;
+	MappedRegion(const MappedRegion& other) = delete;
+	MappedRegion& operator=(const MappedRegion& other) = delete;
+	~MappedRegion();
+
+	[[nodiscard]] unsigned char* data() const noexcept;
+	[[nodiscard]] std::size_t size() const noexcept;
+	[[nodiscard]] unsigned char* pinned() const noexcept;
+
+	void pin(std::size_t size);
+	void resize(std::size_t new_size);
+	void remap();
+	void flush();
+	void swap(MappedRegion& other) noexcept;
+};
+
+inline MappedRegion::MappedRegion(int fd) : fd_(fd)
+{
+	struct stat info = {};
+	if (::fstat(fd_, &info) != 0)
+	{
+		const int error = errno;
+		::close(fd_);
+		throw std::system_error(error, std::generic_category(), "fstat");
+	}
+
+	try
+	{
+		map(static_cast< std::size_t >(info.st_size));
+	} catch (...)
+	{
+		::close(fd_);
+		throw;
+	}
+}
+
+inline MappedRegion::MappedRegion(MappedRegion&& other) noexcept :
+	fd_(other.fd_), data_(other.data_), size_(other.size_), pinned_(other.pinned_), pinned_size_(other.pinned_size_)
+{
+	other.fd_ = -1;
+	other.data_ = nullptr;
+	other.size_ = 0;
+	other.pinned_ = nullptr;
+	other.pinned_size_ = 0;
+}
+
+inline MappedRegion& MappedRegion::operator=(MappedRegion&& other) noexcept
+{
+	if (this != &other)
+	{
+		MappedRegion temp(std::move(other));
+		swap(temp);
+	}
+	return *this;
+}
+
+inline MappedRegion::~MappedRegion()
+{
+	unmap();
+	if (pinned_)
+		::munmap(pinned_, pinned_size_);
+	if (fd_ >= 0)
+		::close(fd_);
+}
+
+inline void MappedRegion::map(std::size_t size)
+{
+	void* data = nullptr;
+	if (size > 0)
+	{
+		data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+		if (data == MAP_FAILED)
+			throw std::system_error(errno, std::generic_category(), "mmap");
+	}
+
+	unmap();
+	data_ = static_cast< unsigned char* >(data);
+	size_ = size;
+}
+
+inline void MappedRegion::unmap() noexcept
+{
+	if (data_)
+		::munmap(data_, size_);
+	data_ = nullptr;
+	size_ = 0;
+}
+
+inline unsigned char* MappedRegion::data() const noexcept
+{
+	return data_;
+}
+
+inline std::size_t MappedRegion::size() const noexcept
+{
+	return size_;
+}
+
+inline unsigned char* MappedRegion::pinned() const noexcept
+{
+	return pinned_;
+}
+
+inline void MappedRegion::pin(std::size_t size)
+{
+	void* pinned = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+	if (pinned == MAP_FAILED)
+		throw std::system_error(errno, std::generic_category(), "mmap");
+
+	if (pinned_)
+		::munmap(pinned_, pinned_size_);
+	pinned_ = static_cast< unsigned char* >(pinned);
+	pinned_size_ = size;
+}
+
+// Grows or shrinks the file and maps it again; the base address may change.
+inline void MappedRegion::resize(std::size_t new_size)
+{
+	if (::ftruncate(fd_, static_cast< off_t >(new_size)) != 0)
+		throw std::system_error(errno, std::generic_category(), "ftruncate");
+
+	map(new_size);
+}
+
+// Maps the file again if another process has resized it.
+inline void MappedRegion::remap()
+{
+	struct stat info = {};
+	if (::fstat(fd_, &info) != 0)
+		throw std::system_error(errno, std::generic_category(), "fstat");
+
+	if (static_cast< std::size_t >(info.st_size) != size_)
+		map(static_cast< std::size_t >(info.st_size));
+}
+
+inline void MappedRegion::flush()
+{
+	if (data_ && ::msync(data_, size_, MS_SYNC) != 0)
+		throw std::system_error(errno, std::generic_category(), "msync");
+}
+
+inline void MappedRegion::swap(MappedRegion& other) noexcept
+{
+	std::swap(fd_, other.fd_);
+	std::swap(data_, other.data_);
+	std::swap(size_, other.size_);
+	std::swap(pinned_, other.pinned_);
+	std::swap(pinned_size_, other.pinned_size_);
+}
+
+// BucketStorage whose blocks live in a memory-mapped file. Every link is an
+// offset from the start of the mapping (blocks) or a slot index (elements),
+// so open() on an existing file can iterate straight away, without any
+// deserialization. The file grows by doubling; iterators store offsets and
+// stay valid across growth, plain pointers and references do not.
+//
+// create_shared()/open_shared() place the same layout in a POSIX shared
+// memory object instead of a file, so several processes can map one storage:
+// a producer fills it while other processes iterate it zero-copy. Access is
+// coordinated with the process-shared lock kept in the header: writers hold
+// lock(), readers hold lock_shared() (std::unique_lock / std::shared_lock
+// work directly). Taking either lock also picks up growth done by another
+// process; threads of one process that share the lock remap one at a time.
+template< typename T >
+class MappedBucketStorage
+{
+	static_assert(std::is_trivially_copyable_v< T >, "MappedBucketStorage needs a trivially copyable value_type.");
+
+  public:
+	using value_type = T;
+	using size_type = std::size_t;
+	using reference = value_type&;
+	using const_reference = const value_type&;
+	using pointer = value_type*;
+	using const_pointer = const value_type*;
+
+	template< bool IsConst >
+	class Iterator
+	{
+	  private:
+		template< bool >
+		friend class Iterator;
+
+		using storage_pointer = conditional_t< IsConst, const MappedBucketStorage*, MappedBucketStorage* >;
+
+		storage_pointer owner_{ nullptr };
+		std::uint64_t current_block_{ 0 };
+		size_type current_index_{ 0 };
+		size_type current_position_{ 0 };
+
+	  public:
+		using difference_type = std::ptrdiff_t;
+		using value_type = T;
+		using pointer = conditional_t< IsConst, const value_type*, value_type* >;
+		using reference = conditional_t< IsConst, const value_type&, value_type& >;
+		using iterator_category = std::bidirectional_iterator_tag;
+
+		explicit Iterator(storage_pointer owner, std::uint64_t current_block, size_type current_index, size_type current_position = 0);
+		template< bool OtherIsConst, typename = std::enable_if_t< IsConst && !OtherIsConst > >
+		Iterator(const Iterator< OtherIsConst >& other);
+
+		template< bool OtherIsConst >
+		bool operator==(const Iterator< OtherIsConst >& other) const;
+		template< bool OtherIsConst >
+		bool operator!=(const Iterator< OtherIsConst >& other) const;
+
+		Iterator& operator++();
+		Iterator operator++(int);
+		Iterator& operator--();
+		Iterator operator--(int);
+
+		bool operator<(const Iterator& other) const;
+		bool operator>(const Iterator& other) const;
+		bool operator<=(const Iterator& other) const;
+		bool operator>=(const Iterator& other) const;
+
+		reference operator*() const;
+		pointer operator->() const;
+
+		[[nodiscard]] std::uint64_t getCurrentBlock() const;
+		[[nodiscard]] size_type getCurrentIndex() const;
+		[[nodiscard]] size_type getCurrentPosition() const;
+	};
+
+	using iterator = Iterator< false >;
+	using const_iterator = Iterator< true >;
+	using difference_type = typename iterator::difference_type;
+
+	static MappedBucketStorage create(const std::string& path, size_type block_capacity = 64);
+	static MappedBucketStorage open(const std::string& path);
+	static MappedBucketStorage create_shared(const std::string& name, size_type block_capacity = 64);
+	static MappedBucketStorage open_shared(const std::string& name);
+	static void remove_shared(const std::string& name);
+
+	MappedBucketStorage(MappedBucketStorage&& other) noexcept = default;
+	MappedBucketStorage& operator=(MappedBucketStorage&& other) noexcept = default;
+	MappedBucketStorage(const MappedBucketStorage& other) = delete;
+	MappedBucketStorage& operator=(const MappedBucketStorage& other) = delete;
+	~MappedBucketStorage() = default;
+
+	iterator begin() noexcept;
+	iterator end() noexcept;
+	const_iterator begin() const noexcept;
+	const_iterator end() const noexcept;
+	const_iterator cbegin() const noexcept;
+	const_iterator cend() const noexcept;
+
+	iterator insert(const value_type& value);
+	iterator erase(const_iterator pos);
+
+	[[nodiscard]] size_type size() const noexcept;
+	[[nodiscard]] bool empty() const noexcept;
+	[[nodiscard]] size_type capacity() const noexcept;
+
+	void clear() noexcept;
+	void flush();
+	void swap(MappedBucketStorage& other) noexcept;
+
+	void lock();
+	void unlock() noexcept;
+	void lock_shared();
+	void unlock_shared() noexcept;
+
+  private:
+	using element_type = Element< T >;
+	static constexpr size_type npos = element_type::npos;
+	static constexpr std::uint32_t magic = 0x504D424B;
+	static constexpr std::uint32_t version = 2;
+
+	struct Header
+	{
+		std::uint32_t magic;
+		std::uint32_t version;
+		std::uint64_t value_size;
+		std::uint64_t value_alignment;
+		std::uint64_t block_capacity;
+		std::uint64_t size;
+		std::uint64_t block_count;
+		std::uint64_t head_block;
+		std::uint64_t tail_block;
+		std::uint64_t last_deleting;
+		std::uint64_t free_blocks;
+		std::uint64_t end;
+		pthread_rwlock_t lock;
+	};
+
+	// Block header; the element array and the payload follow it in the file.
+	struct MappedBlock
+	{
+		std::uint64_t next;
+		std::uint64_t previous;
+		std::uint64_t next_deleting;
+		std::uint64_t previous_deleting;
+		std::uint64_t size;
+		std::uint64_t used;
+		std::uint64_t first;
+		std::uint64_t last;
+		std::uint64_t deleted_cells;
+		std::uint64_t deleted_count;
+	};
+
+	MappedRegion region_;
+	// Readers share the rwlock, so remapping needs a lock of its own; the
+	// rwlock itself is reached through the pinned header, which a remap by
+	// another thread does not move.
+	std::unique_ptr< std::mutex > remap_mutex_;
+
+	explicit MappedBucketStorage(MappedRegion region);
+
+	static MappedBucketStorage initialize(MappedRegion region, size_type block_capacity);
+	static MappedBucketStorage validate(MappedRegion region, const std::string& path, bool shared);
+	static void validateLayout(const MappedRegion& region, const std::string& path);
+	static void initializeLock(Header& header);
+	static bool validBlock(const Header& header, std::uint64_t block) noexcept;
+	static bool validChain(const unsigned char* data, const Header& header) noexcept;
+	static bool validCells(const unsigned char* data, std::uint64_t block, const MappedBlock& target) noexcept;
+	void refresh();
+
+	static constexpr std::size_t alignUp(std::size_t value, std::size_t alignment) noexcept;
+	static constexpr std::size_t blockAlignment() noexcept;
+	static constexpr std::size_t firstBlockOffset() noexcept;
+	static constexpr std::size_t elementsOffset() noexcept;
+	static std::size_t valuesOffset(size_type block_capacity) noexcept;
+	static std::size_t blockBytes(size_type block_capacity) noexcept;
+
+	Header& header() const noexcept;
+	pthread_rwlock_t& sharedLock() const noexcept;
+	MappedBlock& blockAt(std::uint64_t offset) const noexcept;
+	element_type& elementAt(std::uint64_t block, size_type index) const noexcept;
+	T& valueAt(std::uint64_t block, size_type index) const noexcept;
+
+	std::uint64_t firstFilledBlock(std::uint64_t block) const noexcept;
+	std::uint64_t lastFilledBlock(std::uint64_t block) const noexcept;
+
+	std::uint64_t addBlock();
+	void delBlock(std::uint64_t block) noexcept;
+	void pushDeleting(std::uint64_t block) noexcept;
+	void popDeleting(std::uint64_t block) noexcept;
+	void link(std::uint64_t block, size_type index) noexcept;
+	void unlink(std::uint64_t block, size_type index) noexcept;
+};
+
+template< typename T >
+template< bool IsConst >
+MappedBucketStorage< T >::Iterator< IsConst >::Iterator(storage_pointer owner, std::uint64_t current_block, size_type current_index, size_type current_position) :
+	owner_(owner), current_block_(current_block), current_index_(current_index), current_position_(current_position)
+{
+}
+
+template< typename T >
+template< bool IsConst >
+template< bool OtherIsConst, typename >
+MappedBucketStorage< T >::Iterator< IsConst >::Iterator(const Iterator< OtherIsConst >& other) :
+	owner_(other.owner_), current_block_(other.current_block_), current_index_(other.current_index_),
+	current_position_(other.current_position_)
+{
+}
+
+template< typename T >
+template< bool IsConst >
+template< bool OtherIsConst >
+bool MappedBucketStorage< T >::Iterator< IsConst >::operator==(const Iterator< OtherIsConst >& other) const
+{
+	return current_block_ == other.getCurrentBlock() && (!current_block_ || current_index_ == other.getCurrentIndex());
+}
+
+template< typename T >
+template< bool IsConst >
+template< bool OtherIsConst >
+bool MappedBucketStorage< T >::Iterator< IsConst >::operator!=(const Iterator< OtherIsConst >& other) const
+{
+	return !(*this == other);
+}
+
+template< typename T >
+template< bool IsConst >
+typename MappedBucketStorage< T >::template Iterator< IsConst >& MappedBucketStorage< T >::Iterator< IsConst >::operator++()
+{
+	if (!current_block_)
+		return *this;
+
+	size_type next = owner_->elementAt(current_block_, current_index_).getNext();
+	if (next == npos)
+	{
+		current_block_ = owner_->firstFilledBlock(owner_->blockAt(current_block_).next);
+		next = current_block_ ? owner_->blockAt(current_block_).first : 0;
+	}
+
+	current_index_ = next;
+	current_position_++;
+
+	return *this;
+}
+
+template< typename T >
+template< bool IsConst >
+typename MappedBucketStorage< T >::template Iterator< IsConst > MappedBucketStorage< T >::Iterator< IsConst >::operator++(int)
+{
+	Iterator temp = *this;
+	++(*this);
+	return temp;
+}
+
+template< typename T >
+template< bool IsConst >
+typename MappedBucketStorage< T >::template Iterator< IsConst >& MappedBucketStorage< T >::Iterator< IsConst >::operator--()
+{
+	size_type previous = current_block_ ? owner_->elementAt(current_block_, current_index_).getPrevious() : npos;
+	if (previous == npos)
+	{
+		current_block_ = owner_->lastFilledBlock(current_block_ ? owner_->blockAt(current_block_).previous : owner_->header().tail_block);
+		previous = current_block_ ? owner_->blockAt(current_block_).last : 0;
+	}
+
+	current_index_ = previous;
+	current_position_--;
+
+	return *this;
+}
+
+template< typename T >
+template< bool IsConst >
+typename MappedBucketStorage< T >::template Iterator< IsConst > MappedBucketStorage< T >::Iterator< IsConst >::operator--(int)
+{
+	Iterator temp = *this;
+	--(*this);
+	return temp;
+}
+
+template< typename T >
+template< bool IsConst >
+bool MappedBucketStorage< T >::Iterator< IsConst >::operator<(const Iterator& other) const
+{
+	return current_position_ < other.current_position_;
+}
+
+template< typename T >
+template< bool IsConst >
+bool MappedBucketStorage< T >::Iterator< IsConst >::operator>(const Iterator& other) const
+{
+	return current_position_ > other.current_position_;
+}
+
+template< typename T >
+template< bool IsConst >
+bool MappedBucketStorage< T >::Iterator< IsConst >::operator<=(const Iterator& other) const
+{
+	return current_position_ <= other.current_position_;
+}
+
+template< typename T >
+template< bool IsConst >
+bool MappedBucketStorage< T >::Iterator< IsConst >::operator>=(const Iterator& other) const
+{
+	return current_position_ >= other.current_position_;
+}
+
+template< typename T >
+template< bool IsConst >
+typename MappedBucketStorage< T >::template Iterator< IsConst >::reference MappedBucketStorage< T >::Iterator< IsConst >::operator*() const
+{
+	return owner_->valueAt(current_block_, current_index_);
+}
+
+template< typename T >
+template< bool IsConst >
+typename MappedBucketStorage< T >::template Iterator< IsConst >::pointer MappedBucketStorage< T >::Iterator< IsConst >::operator->() const
+{
+	return &**this;
+}
+
+template< typename T >
+template< bool IsConst >
+std::uint64_t MappedBucketStorage< T >::Iterator< IsConst >::getCurrentBlock() const
+{
+	return current_block_;
+}
+
+template< typename T >
+template< bool IsConst >
+typename MappedBucketStorage< T >::size_type MappedBucketStorage< T >::Iterator< IsConst >::getCurrentIndex() const
+{
+	return current_index_;
+}
+
+template< typename T >
+template< bool IsConst >
+typename MappedBucketStorage< T >::size_type MappedBucketStorage< T >::Iterator< IsConst >::getCurrentPosition() const
+{
+	return current_position_;
+}
+
+template< typename T >
+MappedBucketStorage< T >::MappedBucketStorage(MappedRegion region) :
+	region_(std::move(region)), remap_mutex_(std::make_unique< std::mutex >())
+{
+	region_.pin(sizeof(Header));
+}
+
+template< typename T >
+MappedBucketStorage< T > MappedBucketStorage< T >::create(const std::string& path, size_type block_capacity)
+{
+	if (block_capacity == 0)
+		throw std::invalid_argument("The block size cannot be equal to 0.");
+
+	const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		throw std::system_error(errno, std::generic_category(), "open " + path);
+
+	return initialize(MappedRegion(fd), block_capacity);
+}
+
+// A file has a single owner, so a lock left held by a crashed process is reset.
+template< typename T >
+MappedBucketStorage< T > MappedBucketStorage< T >::open(const std::string& path)
+{
+	const int fd = ::open(path.c_str(), O_RDWR);
+	if (fd < 0)
+		throw std::system_error(errno, std::generic_category(), "open " + path);
+
+	MappedBucketStorage storage = validate(MappedRegion(fd), path, false);
+	::pthread_rwlock_destroy(&storage.header().lock);
+	initializeLock(storage.header());
+	return storage;
+}
+
+template< typename T >
+MappedBucketStorage< T > MappedBucketStorage< T >::create_shared(const std::string& name, size_type block_capacity)
+{
+	if (block_capacity == 0)
+		throw std::invalid_argument("The block size cannot be equal to 0.");
+
+	const int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0)
+		throw std::system_error(errno, std::generic_category(), "shm_open " + name);
+
+	try
+	{
+		return initialize(MappedRegion(fd), block_capacity);
+	} catch (...)
+	{
+		::shm_unlink(name.c_str());
+		throw;
+	}
+}
+
+template< typename T >
+MappedBucketStorage< T > MappedBucketStorage< T >::open_shared(const std::string& name)
+{
+	const int fd = ::shm_open(name.c_str(), O_RDWR, 0600);
+	if (fd < 0)
+		throw std::system_error(errno, std::generic_category(), "shm_open " + name);
+
+	return validate(MappedRegion(fd), name, true);
+}
+
+template< typename T >
+void MappedBucketStorage< T >::remove_shared(const std::string& name)
+{
+	if (::shm_unlink(name.c_str()) != 0 && errno != ENOENT)
+		throw std::system_error(errno, std::generic_category(), "shm_unlink " + name);
+}
+
+template< typename T >
+MappedBucketStorage< T > MappedBucketStorage< T >::initialize(MappedRegion region, size_type block_capacity)
+{
+	region.resize(firstBlockOffset() + blockBytes(block_capacity));
+
+	auto* header = ::new (static_cast< void* >(region.data())) Header{};
+	header->magic = magic;
+	header->version = version;
+	header->value_size = sizeof(T);
+	header->value_alignment = alignof(T);
+	header->block_capacity = block_capacity;
+	header->end = firstBlockOffset();
+	initializeLock(*header);
+
+	return MappedBucketStorage(std::move(region));
+}
+
+template< typename T >
+MappedBucketStorage< T > MappedBucketStorage< T >::validate(MappedRegion region, const std::string& path, bool shared)
+{
+	if (region.size() < firstBlockOffset())
+		throw std::runtime_error(path + " is not a MappedBucketStorage file.");
+
+	const auto* header = reinterpret_cast< const Header* >(region.data());
+	if (header->magic != magic || header->version != version)
+		throw std::runtime_error(path + " is not a MappedBucketStorage file.");
+	if (header->value_size != sizeof(T) || header->value_alignment != alignof(T))
+		throw std::runtime_error(path + " was written for another value_type.");
+
+	// Other processes may be writing a shared segment, so its layout is
+	// checked under the shared lock, on a mapping brought up to date.
+	pthread_rwlock_t* lock = nullptr;
+	if (shared)
+	{
+		region.pin(sizeof(Header));
+		lock = &reinterpret_cast< Header* >(region.pinned())->lock;
+		::pthread_rwlock_rdlock(lock);
+	}
+
+	try
+	{
+		region.remap();
+		validateLayout(region, path);
+	} catch (...)
+	{
+		if (lock)
+			::pthread_rwlock_unlock(lock);
+		throw;
+	}
+	if (lock)
+		::pthread_rwlock_unlock(lock);
+
+	// Offsets and indices are followed without further checks from here on;
+	// the file is only checked when opened, so processes sharing it have to
+	// be trusted not to corrupt it afterwards.
+	return MappedBucketStorage(std::move(region));
+}
+
+template< typename T >
+void MappedBucketStorage< T >::validateLayout(const MappedRegion& region, const std::string& path)
+{
+	const auto* header = reinterpret_cast< const Header* >(region.data());
+	if (header->block_capacity == 0 || header->block_capacity > region.size() || header->end > region.size() ||
+		header->end < firstBlockOffset())
+		throw std::runtime_error(path + " is corrupted.");
+
+	if (!validBlock(*header, header->head_block) || !validBlock(*header, header->tail_block) ||
+		!validBlock(*header, header->last_deleting) || !validChain(region.data(), *header))
+		throw std::runtime_error(path + " is corrupted.");
+
+	const std::uint64_t block_limit = (header->end - firstBlockOffset()) / blockBytes(header->block_capacity);
+	std::uint64_t free_blocks = 0;
+	for (std::uint64_t block = header->free_blocks; block; block = reinterpret_cast< const MappedBlock* >(region.data() + block)->next)
+		if (!validBlock(*header, block) || ++free_blocks > block_limit)
+			throw std::runtime_error(path + " is corrupted.");
+}
+
+// Walks the blocks from the head once: every link stays inside the file, the
+// chain ends at the tail and the per-block counts add up to the header's.
+template< typename T >
+bool MappedBucketStorage< T >::validChain(const unsigned char* data, const Header& header) noexcept
+{
+	const std::uint64_t block_limit = (header.end - firstBlockOffset()) / blockBytes(header.block_capacity);
+	std::uint64_t block_count = 0;
+	std::uint64_t size = 0;
+	std::uint64_t previous = 0;
+	for (std::uint64_t block = header.head_block; block; block = reinterpret_cast< const MappedBlock* >(data + block)->next)
+	{
+		const auto& target = *reinterpret_cast< const MappedBlock* >(data + block);
+		if (!validBlock(header, block) || ++block_count > block_limit || target.previous != previous ||
+			!validBlock(header, target.next_deleting) || !validBlock(header, target.previous_deleting) ||
+			target.used > header.block_capacity || target.size + target.deleted_count != target.used ||
+			!validCells(data, block, target))
+			return false;
+
+		size += target.size;
+		previous = block;
+	}
+
+	return previous == header.tail_block && block_count == header.block_count && size == header.size;
+}
+
+// The active and deleted lists of a block cover its used cells exactly.
+template< typename T >
+bool MappedBucketStorage< T >::validCells(const unsigned char* data, std::uint64_t block, const MappedBlock& target) noexcept
+{
+	const auto* elements = reinterpret_cast< const element_type* >(data + block + elementsOffset());
+
+	size_type count = 0;
+	size_type previous = npos;
+	for (size_type index = target.first; index != npos; index = elements[index].getNext())
+	{
+		if (index >= target.used || ++count > target.size || !elements[index].isActive() ||
+			elements[index].getPrevious() != previous)
+			return false;
+		previous = index;
+	}
+	if (count != target.size || previous != target.last)
+		return false;
+
+	count = 0;
+	for (size_type index = target.deleted_cells; index != npos; index = elements[index].getNext())
+		if (index >= target.used || ++count > target.deleted_count || elements[index].isActive())
+			return false;
+
+	return count == target.deleted_count;
+}
+
+// 0 or the offset of a whole block below header.end.
+template< typename T >
+bool MappedBucketStorage< T >::validBlock(const Header& header, std::uint64_t block) noexcept
+{
+	const std::size_t bytes = blockBytes(header.block_capacity);
+	return block == 0 || (block >= firstBlockOffset() && block <= header.end && header.end - block >= bytes &&
+							 (block - firstBlockOffset()) % bytes == 0);
+}
+
+template< typename T >
+void MappedBucketStorage< T >::initializeLock(Header& header)
+{
+	pthread_rwlockattr_t attributes;
+	::pthread_rwlockattr_init(&attributes);
+	::pthread_rwlockattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+	const int error = ::pthread_rwlock_init(&header.lock, &attributes);
+	::pthread_rwlockattr_destroy(&attributes);
+
+	if (error != 0)
+		throw std::system_error(error, std::generic_category(), "pthread_rwlock_init");
+}
+
+template< typename T >
+constexpr std::size_t MappedBucketStorage< T >::alignUp(std::size_t value, std::size_t alignment) noexcept
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+template< typename T >
+constexpr std::size_t MappedBucketStorage< T >::blockAlignment() noexcept
+{
+	return std::max({ alignof(T), alignof(MappedBlock), alignof(element_type) });
+}
+
+template< typename T >
+constexpr std::size_t MappedBucketStorage< T >::firstBlockOffset() noexcept
+{
+	return alignUp(sizeof(Header), blockAlignment());
+}
+
+template< typename T >
+constexpr std::size_t MappedBucketStorage< T >::elementsOffset() noexcept
+{
+	return alignUp(sizeof(MappedBlock), alignof(element_type));
+}
+
+template< typename T >
+std::size_t MappedBucketStorage< T >::valuesOffset(size_type block_capacity) noexcept
+{
+	return alignUp(elementsOffset() + block_capacity * sizeof(element_type), alignof(T));
+}
+
+template< typename T >
+std::size_t MappedBucketStorage< T >::blockBytes(size_type block_capacity) noexcept
+{
+	return alignUp(valuesOffset(block_capacity) + block_capacity * sizeof(T), blockAlignment());
+}
+
+template< typename T >
+typename MappedBucketStorage< T >::Header& MappedBucketStorage< T >::header() const noexcept
+{
+	return *reinterpret_cast< Header* >(region_.data());
+}
+
+template< typename T >
+pthread_rwlock_t& MappedBucketStorage< T >::sharedLock() const noexcept
+{
+	return reinterpret_cast< Header* >(region_.pinned())->lock;
+}
+
+template< typename T >
+typename MappedBucketStorage< T >::MappedBlock& MappedBucketStorage< T >::blockAt(std::uint64_t offset) const noexcept
+{
+	return *reinterpret_cast< MappedBlock* >(region_.data() + offset);
+}
+
+template< typename T >
+typename MappedBucketStorage< T >::element_type& MappedBucketStorage< T >::elementAt(std::uint64_t block, size_type index) const noexcept
+{
+	return reinterpret_cast< element_type* >(region_.data() + block + elementsOffset())[index];
+}
+
+template< typename T >
+T& MappedBucketStorage< T >::valueAt(std::uint64_t block, size_type index) const noexcept
+{
+	return reinterpret_cast< T* >(region_.data() + block + valuesOffset(header().block_capacity))[index];
+}
+
+template< typename T >
+std::uint64_t MappedBucketStorage< T >::firstFilledBlock(std::uint64_t block) const noexcept
+{
+	while (block && blockAt(block).first == npos)
+		block = blockAt(block).next;
+	return block;
+}
+
+template< typename T >
+std::uint64_t MappedBucketStorage< T >::lastFilledBlock(std::uint64_t block) const noexcept
+{
+	while (block && blockAt(block).last == npos)
+		block = blockAt(block).previous;
+	return block;
+}
+
+// Takes a released block or carves a new one past header().end, growing the
+// file when needed. Growing may move the mapping.
+template< typename T >
+std::uint64_t MappedBucketStorage< T >::addBlock()
+{
+	const size_type block_capacity = header().block_capacity;
+	std::uint64_t block = header().free_blocks;
+
+	if (block)
+		header().free_blocks = blockAt(block).next;
+	else
+	{
+		const std::size_t bytes = blockBytes(block_capacity);
+		block = header().end;
+		if (block + bytes > region_.size())
+			region_.resize(std::max(region_.size() * 2, static_cast< std::size_t >(block + bytes)));
+		header().end = block + bytes;
+	}
+
+	::new (static_cast< void* >(&blockAt(block))) MappedBlock{ 0, header().tail_block, 0, 0, 0, 0, npos, npos, npos, 0 };
+	for (size_type index = 0; index < block_capacity; ++index)
+		::new (static_cast< void* >(&elementAt(block, index))) element_type();
+
+	if (header().tail_block)
+		blockAt(header().tail_block).next = block;
+	else
+		header().head_block = block;
+
+	header().tail_block = block;
+	++header().block_count;
+	return block;
+}
+
+template< typename T >
+void MappedBucketStorage< T >::delBlock(std::uint64_t block) noexcept
+{
+	MappedBlock& target = blockAt(block);
+	popDeleting(block);
+
+	if (target.previous)
+		blockAt(target.previous).next = target.next;
+	else
+		header().head_block = target.next;
+
+	if (target.next)
+		blockAt(target.next).previous = target.previous;
+	else
+		header().tail_block = target.previous;
+
+	target.next = header().free_blocks;
+	header().free_blocks = block;
+	--header().block_count;
+}
+
+template< typename T >
+void MappedBucketStorage< T >::pushDeleting(std::uint64_t block) noexcept
+{
+	if (header().last_deleting == block)
+		return;
+
+	popDeleting(block);
+
+	blockAt(block).next_deleting = header().last_deleting;
+	if (header().last_deleting)
+		blockAt(header().last_deleting).previous_deleting = block;
+
+	header().last_deleting = block;
+}
+
+template< typename T >
+void MappedBucketStorage< T >::popDeleting(std::uint64_t block) noexcept
+{
+	MappedBlock& target = blockAt(block);
+	if (header().last_deleting != block && !target.previous_deleting)
+		return;
+
+	if (target.previous_deleting)
+		blockAt(target.previous_deleting).next_deleting = target.next_deleting;
+	else
+		header().last_deleting = target.next_deleting;
+
+	if (target.next_deleting)
+		blockAt(target.next_deleting).previous_deleting = target.previous_deleting;
+
+	target.next_deleting = 0;
+	target.previous_deleting = 0;
+}
+
+template< typename T >
+void MappedBucketStorage< T >::link(std::uint64_t block, size_type index) noexcept
+{
+	MappedBlock& target = blockAt(block);
+	element_type& element = elementAt(block, index);
+
+	element.setIsActive(true);
+	element.setNext(npos);
+	element.setPrevious(target.last);
+
+	if (target.last != npos)
+		elementAt(block, target.last).setNext(index);
+	else
+		target.first = index;
+
+	target.last = index;
+	++target.size;
+}
+
+template< typename T >
+void MappedBucketStorage< T >::unlink(std::uint64_t block, size_type index) noexcept
+{
+	MappedBlock& target = blockAt(block);
+	element_type& element = elementAt(block, index);
+
+	if (element.getPrevious() != npos)
+		elementAt(block, element.getPrevious()).setNext(element.getNext());
+	else
+		target.first = element.getNext();
+
+	if (element.getNext() != npos)
+		elementAt(block, element.getNext()).setPrevious(element.getPrevious());
+	else
+		target.last = element.getPrevious();
+
+	element.setIsActive(false);
+	element.nextGeneration();
+	element.setPrevious(npos);
+	element.setNext(target.deleted_cells);
+	target.deleted_cells = index;
+	++target.deleted_count;
+	--target.size;
+}
+
+template< typename T >
+typename MappedBucketStorage< T >::iterator MappedBucketStorage< T >::begin() noexcept
+{
+	const std::uint64_t block = firstFilledBlock(header().head_block);
+	return iterator(this, block, block ? blockAt(block).first : 0);
+}
+
+template< typename T >
+typename MappedBucketStorage< T >::iterator MappedBucketStorage< T >::end() noexcept
+{
+	return iterator(this, 0, 0, size());
+}
+
+template< typename T >
+typename MappedBucketStorage< T >::const_iterator MappedBucketStorage< T >::begin() const noexcept
+{
+	const std::uint64_t block = firstFilledBlock(header().head_block);
+	return const_iterator(this, block, block ? blockAt(block).first : 0);
+}
+
+template< typename T >
+typename MappedBucketStorage< T >::const_iterator MappedBucketStorage< T >::end() const noexcept
+{
+	return const_iterator(this, 0, 0, size());
+}
+
+template< typename T >
+typename MappedBucketStorage< T >::const_iterator MappedBucketStorage< T >::cbegin() const noexcept
+{
+	return begin();
+}
+
+template< typename T >
+typename MappedBucketStorage< T >::const_iterator MappedBucketStorage< T >::cend() const noexcept
+{
+	return end();
+}
+
+template< typename T >
+typename MappedBucketStorage< T >::iterator MappedBucketStorage< T >::insert(const value_type& value)
+{
+	// value may live in the mapping, which addBlock() is allowed to move
+	const value_type copy = value;
+	std::uint64_t block = header().last_deleting;
+	size_type index = 0;
+
+	if (block)
+	{
+		MappedBlock& target = blockAt(block);
+		index = target.deleted_cells;
+		target.deleted_cells = elementAt(block, index).getNext();
+		if (--target.deleted_count == 0)
+			popDeleting(block);
+	}
+	else
+	{
+		block = header().tail_block;
+		if (!block || blockAt(block).used == header().block_capacity)
+			block = addBlock();
+		index = blockAt(block).used++;
+	}
+
+	::new (static_cast< void* >(&valueAt(block, index))) T(copy);
+	link(block, index);
+	++header().size;
+
+	return iterator(this, block, index);
+}
+
+template< typename T >
+typename MappedBucketStorage< T >::iterator MappedBucketStorage< T >::erase(const_iterator pos)
+{
+	const std::uint64_t block = pos.getCurrentBlock();
+	const size_type index = pos.getCurrentIndex();
+
+	iterator next(this, block, index, pos.getCurrentPosition());
+	++next;
+
+	unlink(block, index);
+	--header().size;
+
+	const MappedBlock& target = blockAt(block);
+	if (target.size == 0 && target.used == header().block_capacity)
+		delBlock(block);
+	else
+		pushDeleting(block);
+
+	return next;
+}
+
+template< typename T >
+typename MappedBucketStorage< T >::size_type MappedBucketStorage< T >::size() const noexcept
+{
+	return region_.data() ? header().size : 0;
+}
+
+template< typename T >
+bool MappedBucketStorage< T >::empty() const noexcept
+{
+	return size() == 0;
+}
+
+template< typename T >
+typename MappedBucketStorage< T >::size_type MappedBucketStorage< T >::capacity() const noexcept
+{
+	return region_.data() ? header().block_count * header().block_capacity : 0;
+}
+
+// Forgets every block but keeps the file size, so refilling does not grow it.
+template< typename T >
+void MappedBucketStorage< T >::clear() noexcept
+{
+	Header& target = header();
+	target.size = 0;
+	target.block_count = 0;
+	target.head_block = 0;
+	target.tail_block = 0;
+	target.last_deleting = 0;
+	target.free_blocks = 0;
+	target.end = firstBlockOffset();
+}
+
+template< typename T >
+void MappedBucketStorage< T >::flush()
+{
+	region_.flush();
+}
+
+template< typename T >
+void MappedBucketStorage< T >::swap(MappedBucketStorage& other) noexcept
+{
+	region_.swap(other.region_);
+}
+
+template< typename T >
+void MappedBucketStorage< T >::refresh()
+{
+	std::lock_guard< std::mutex > lock(*remap_mutex_);
+	if (header().end > region_.size())
+		region_.remap();
+}
+
+template< typename T >
+void MappedBucketStorage< T >::lock()
+{
+	if (const int error = ::pthread_rwlock_wrlock(&sharedLock()))
+		throw std::system_error(error, std::generic_category(), "pthread_rwlock_wrlock");
+
+	try
+	{
+		refresh();
+	} catch (...)
+	{
+		unlock();
+		throw;
+	}
+}
+
+template< typename T >
+void MappedBucketStorage< T >::unlock() noexcept
+{
+	::pthread_rwlock_unlock(&sharedLock());
+}
+
+template< typename T >
+void MappedBucketStorage< T >::lock_shared()
+{
+	if (const int error = ::pthread_rwlock_rdlock(&sharedLock()))
+		throw std::system_error(error, std::generic_category(), "pthread_rwlock_rdlock");
+
+	try
+	{
+		refresh();
+	} catch (...)
+	{
+		unlock_shared();
+		throw;
+	}
+}
+
+template< typename T >
+void MappedBucketStorage< T >::unlock_shared() noexcept
+{
+	::pthread_rwlock_unlock(&sharedLock());
+}
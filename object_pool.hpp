@@ -0,0 +1,286 @@
+#pragma once
+
+#include "bucket_storage.hpp"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Object pool on top of BucketStorage, safe to share between threads.
+// acquire() constructs an object in a pooled slot and returns a move-only
+// Handle that destroys it when the handle goes, in O(1) and without an
+// iterator. Storage changes happen under one lock; with a non-zero
+// cache_size, freed slots are kept (up to cache_size per cache) in one of a
+// few caches picked by thread id, and acquire() on the same thread builds
+// the next object in such a slot without taking that lock. Caches are shared
+// by thread id hash rather than thread_local, so trim() can hand every
+// cached slot back. The pool must outlive its handles.
+template< typename T >
+class ObjectPool
+{
+	static_assert(std::is_nothrow_destructible_v< T >, "Handles destroy objects from noexcept paths.");
+
+	// Raw room for one T; objects live in it only while a handle owns them.
+	struct Slot
+	{
+		alignas(T) unsigned char bytes[sizeof(T)];
+
+		Slot() noexcept {}
+	};
+
+  public:
+	using value_type = T;
+	using size_type = std::size_t;
+	using storage_type = BucketStorage< Slot >;
+
+	class Handle
+	{
+	  private:
+		ObjectPool* pool_{ nullptr };
+		T* value_{ nullptr };
+		typename storage_type::Handle slot_;
+
+		Handle(ObjectPool* pool, T* value, typename storage_type::Handle slot) noexcept;
+
+		friend class ObjectPool;
+
+	  public:
+		Handle() noexcept = default;
+		Handle(Handle&& other) noexcept;
+		Handle& operator=(Handle&& other) noexcept;
+		Handle(const Handle& other) = delete;
+		Handle& operator=(const Handle& other) = delete;
+		~Handle();
+
+		T& operator*() const noexcept;
+		T* operator->() const noexcept;
+		[[nodiscard]] T* get() const noexcept;
+		explicit operator bool() const noexcept;
+
+		void reset() noexcept;
+	};
+
+  private:
+	static constexpr size_type cache_count = 8;
+
+	struct CachedSlot
+	{
+		Slot* slot;
+		typename storage_type::Handle handle;
+	};
+
+	struct Cache
+	{
+		std::mutex mutex;
+		std::vector< CachedSlot > slots;
+	};
+
+	mutable std::mutex mutex_;
+	storage_type storage_;
+	std::atomic< size_type > in_use_{ 0 };
+	size_type cache_size_;
+	std::array< Cache, cache_count > caches_;
+
+	Cache& localCache() noexcept;
+	CachedSlot takeSlot();
+	void giveSlot(const CachedSlot& slot) noexcept;
+	void release(T* value, typename storage_type::Handle slot) noexcept;
+
+  public:
+	explicit ObjectPool(size_type cache_size = 0, size_type block_capacity = storage_type::default_block_capacity);
+	ObjectPool(const ObjectPool& other) = delete;
+	ObjectPool& operator=(const ObjectPool& other) = delete;
+
+	template< typename... Args >
+	Handle acquire(Args&&... args);
+
+	[[nodiscard]] size_type size() const noexcept;
+	[[nodiscard]] size_type capacity() const;
+	void trim();
+};
+
+template< typename T >
+ObjectPool< T >::Handle::Handle(ObjectPool* pool, T* value, typename storage_type::Handle slot) noexcept :
+	pool_(pool), value_(value), slot_(slot)
+{
+}
+
+template< typename T >
+ObjectPool< T >::Handle::Handle(Handle&& other) noexcept :
+	pool_(std::exchange(other.pool_, nullptr)), value_(std::exchange(other.value_, nullptr)), slot_(other.slot_)
+{
+}
+
+template< typename T >
+typename ObjectPool< T >::Handle& ObjectPool< T >::Handle::operator=(Handle&& other) noexcept
+{
+	if (this != &other)
+	{
+		reset();
+		pool_ = std::exchange(other.pool_, nullptr);
+		value_ = std::exchange(other.value_, nullptr);
+		slot_ = other.slot_;
+	}
+	return *this;
+}
+
+template< typename T >
+ObjectPool< T >::Handle::~Handle()
+{
+	reset();
+}
+
+template< typename T >
+T& ObjectPool< T >::Handle::operator*() const noexcept
+{
+	return *value_;
+}
+
+template< typename T >
+T* ObjectPool< T >::Handle::operator->() const noexcept
+{
+	return value_;
+}
+
+template< typename T >
+T* ObjectPool< T >::Handle::get() const noexcept
+{
+	return value_;
+}
+
+template< typename T >
+ObjectPool< T >::Handle::operator bool() const noexcept
+{
+	return value_ != nullptr;
+}
+
+// Destroys the object ahead of the handle and gives its slot back.
+template< typename T >
+void ObjectPool< T >::Handle::reset() noexcept
+{
+	if (!pool_)
+		return;
+
+	pool_->release(value_, slot_);
+	pool_ = nullptr;
+	value_ = nullptr;
+}
+
+template< typename T >
+ObjectPool< T >::ObjectPool(size_type cache_size, size_type block_capacity) :
+	storage_(block_capacity), cache_size_(cache_size)
+{
+	for (Cache& cache : caches_)
+		cache.slots.reserve(cache_size_);
+}
+
+template< typename T >
+typename ObjectPool< T >::Cache& ObjectPool< T >::localCache() noexcept
+{
+	return caches_[std::hash< std::thread::id >()(std::this_thread::get_id()) % cache_count];
+}
+
+template< typename T >
+template< typename... Args >
+typename ObjectPool< T >::Handle ObjectPool< T >::acquire(Args&&... args)
+{
+	const CachedSlot slot = takeSlot();
+
+	T* value = nullptr;
+	try
+	{
+		value = ::new (static_cast< void* >(slot.slot->bytes)) T(std::forward< Args >(args)...);
+	} catch (...)
+	{
+		giveSlot(slot);
+		throw;
+	}
+	++in_use_;
+	return Handle(this, value, slot.handle);
+}
+
+// A cached slot of this thread's cache, or a new one from the storage.
+template< typename T >
+typename ObjectPool< T >::CachedSlot ObjectPool< T >::takeSlot()
+{
+	if (cache_size_ != 0)
+	{
+		Cache& cache = localCache();
+		std::lock_guard< std::mutex > lock(cache.mutex);
+		if (!cache.slots.empty())
+		{
+			const CachedSlot slot = cache.slots.back();
+			cache.slots.pop_back();
+			return slot;
+		}
+	}
+
+	std::lock_guard< std::mutex > lock(mutex_);
+	auto inserted = storage_.emplace();
+	return CachedSlot{ &*inserted, storage_.handle(inserted) };
+}
+
+// Cache vectors are reserved up front, so caching never allocates.
+template< typename T >
+void ObjectPool< T >::giveSlot(const CachedSlot& slot) noexcept
+{
+	if (cache_size_ != 0)
+	{
+		Cache& cache = localCache();
+		std::lock_guard< std::mutex > lock(cache.mutex);
+		if (cache.slots.size() < cache_size_)
+		{
+			cache.slots.push_back(slot);
+			return;
+		}
+	}
+
+	std::lock_guard< std::mutex > lock(mutex_);
+	storage_.erase(slot.handle);
+}
+
+template< typename T >
+void ObjectPool< T >::release(T* value, typename storage_type::Handle slot) noexcept
+{
+	value->~T();
+	--in_use_;
+	giveSlot(CachedSlot{ reinterpret_cast< Slot* >(value), slot });
+}
+
+// Objects handed out and not yet given back.
+template< typename T >
+typename ObjectPool< T >::size_type ObjectPool< T >::size() const noexcept
+{
+	return in_use_.load(std::memory_order_relaxed);
+}
+
+template< typename T >
+typename ObjectPool< T >::size_type ObjectPool< T >::capacity() const
+{
+	std::lock_guard< std::mutex > lock(mutex_);
+	return storage_.capacity();
+}
+
+// Gives the slots kept in the caches back to the storage.
+template< typename T >
+void ObjectPool< T >::trim()
+{
+	std::vector< CachedSlot > released;
+	for (Cache& cache : caches_)
+	{
+		std::lock_guard< std::mutex > lock(cache.mutex);
+		released.insert(released.end(), cache.slots.begin(), cache.slots.end());
+		cache.slots.clear();
+	}
+
+	std::lock_guard< std::mutex > lock(mutex_);
+	for (const CachedSlot& cached : released)
+		storage_.erase(cached.handle);
+}
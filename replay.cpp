@@ -0,0 +1,161 @@
+// Replays a recorded workload trace against BucketStorage with several
+// block capacities and reports timings and memory.
+//
+//   g++ -std=c++20 -O2 -DNDEBUG -I. replay.cpp -o replay
+//   ./replay trace.bin [--payload 8|64|256|1024] [--grow-to max] [block_capacity ...]
+//
+// Traces come from a build that uses BucketStorage< T, TraceRecorder >:
+//   storage.instrumentation().getTrace().save("trace.bin");
+// With --grow-to every listed capacity is the first block size of a
+// storage whose blocks double up to max. Every capacity runs in a forked
+// child, so the reported peak RSS belongs to that run alone.
+
+#include "bucket_storage_trace.hpp"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <string>
+#include <vector>
+
+namespace
+{
+	template< std::size_t N >
+	struct TracePayload
+	{
+		std::uint64_t id{ 0 };
+		std::array< unsigned char, N - sizeof(std::uint64_t) > pad{};
+
+		explicit TracePayload(std::uint64_t new_id) : id(new_id) {}
+		explicit operator std::uint64_t() const noexcept { return id; }
+	};
+
+	template< std::size_t N >
+	void run(const Trace& trace, std::size_t block_capacity, std::size_t max_block_capacity)
+	{
+		using Storage = BucketStorage< TracePayload< N > >;
+		Storage storage(block_capacity, max_block_capacity);
+		const ReplayResult result = replay(trace, storage);
+		const typename Storage::Stats stats = storage.stats();
+
+		rusage usage{};
+		getrusage(RUSAGE_SELF, &usage);
+
+		const double seconds = static_cast< double >(result.elapsed.count()) / 1e9;
+		const std::string capacity = block_capacity == max_block_capacity
+										 ? std::to_string(block_capacity)
+										 : std::to_string(block_capacity) + "-" + std::to_string(max_block_capacity);
+		std::printf("%10s %12zu %12.3f %10.3f %16zu %12zu %8.3f %10zu %10ld\n",
+					capacity.c_str(),
+					result.operations,
+					seconds * 1e3,
+					static_cast< double >(result.operations) / seconds / 1e6,
+					result.peak_capacity * sizeof(TracePayload< N >) / 1024,
+					stats.size,
+					stats.fragmentation,
+					stats.block_allocations,
+					usage.ru_maxrss);
+		std::fflush(stdout);
+	}
+
+	void dispatch(const Trace& trace, std::size_t payload, std::size_t block_capacity, std::size_t max_block_capacity)
+	{
+		switch (payload)
+		{
+		case 8:
+			return run< 8 >(trace, block_capacity, max_block_capacity);
+		case 64:
+			return run< 64 >(trace, block_capacity, max_block_capacity);
+		case 256:
+			return run< 256 >(trace, block_capacity, max_block_capacity);
+		case 1024:
+			return run< 1024 >(trace, block_capacity, max_block_capacity);
+		default:
+			throw std::invalid_argument("Payload size must be 8, 64, 256 or 1024.");
+		}
+	}
+}	 // namespace
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		std::fprintf(stderr, "usage: %s trace.bin [--payload 8|64|256|1024] [--grow-to max] [block_capacity ...]\n", argv[0]);
+		return 2;
+	}
+
+	std::size_t payload = 8;
+	std::size_t grow_to = 0;
+	std::vector< std::size_t > capacities;
+	for (int i = 2; i < argc; ++i)
+	{
+		if (std::strcmp(argv[i], "--payload") == 0 && i + 1 < argc)
+			payload = std::strtoull(argv[++i], nullptr, 10);
+		else if (std::strcmp(argv[i], "--grow-to") == 0 && i + 1 < argc)
+			grow_to = std::strtoull(argv[++i], nullptr, 10);
+		else
+			capacities.push_back(std::strtoull(argv[i], nullptr, 10));
+	}
+	if (capacities.empty())
+		capacities = { 16, 64, 256, 1024 };
+
+	Trace trace;
+	try
+	{
+		trace.load(argv[1]);
+	} catch (const std::exception& error)
+	{
+		std::fprintf(stderr, "%s\n", error.what());
+		return 1;
+	}
+
+	std::printf("%10s %12s %12s %10s %16s %12s %8s %10s %10s\n",
+				"capacity",
+				"operations",
+				"ms",
+				"Mops/s",
+				"peak payload KB",
+				"final size",
+				"frag",
+				"blocks",
+				"rss KB");
+	std::fflush(stdout);
+
+	int failures = 0;
+	for (const std::size_t capacity : capacities)
+	{
+		const pid_t child = fork();
+		if (child < 0)
+		{
+			std::perror("fork");
+			return 1;
+		}
+		if (child == 0)
+		{
+			try
+			{
+				dispatch(trace, payload, capacity, std::max(capacity, grow_to));
+			} catch (const std::exception& error)
+			{
+				std::fprintf(stderr, "capacity %zu: %s\n", capacity, error.what());
+				std::_Exit(1);
+			}
+			std::_Exit(0);
+		}
+
+		int status = 0;
+		waitpid(child, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			++failures;
+	}
+
+	return failures == 0 ? 0 : 1;
+}
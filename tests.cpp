@@ -1,11 +1,27 @@
 #include "bucket_storage.hpp"
 #include "helpers.h"
+#include "bucket_storage_trace.hpp"
+#include "mapped_bucket_storage.hpp"
+#include "object_pool.hpp"
 #include <type_traits>
 
 #include <gtest/gtest.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <future>
 #include <limits>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <shared_mutex>
+#include <random>
+#include <sstream>
 #include <utility>
 
 TEST(traits, default_constructor)
@@ -56,6 +72,15 @@ TEST(traits, move_constructors)
 	static_assert(noexcept(bs_co_t(std::declval< bs_co_t && >())));
 }
 
+TEST(traits, nothrow_default_and_move)
+{
+	static_assert(std::is_nothrow_default_constructible_v< bs_sizet_t >);
+	static_assert(std::is_nothrow_default_constructible_v< bs_co_t >);
+	static_assert(std::is_nothrow_move_assignable_v< bs_sizet_t >);
+	static_assert(std::is_nothrow_move_assignable_v< bs_nc_t >);
+	static_assert(std::is_nothrow_swappable_v< bs_sizet_t >);
+}
+
 TEST(traits, iterator)
 {
 	using it = typename std::iterator_traits< bs_sizet_t::iterator >::iterator_category;
@@ -319,6 +344,63 @@ TEST(base, clear)
 	ASSERT_EQ(b.begin(), b.end());
 }
 
+TEST(base, destroys_each_element_once)
+{
+	static_assert(!std::is_trivially_destructible_v< CountedOperationObject >);
+	{
+		bs_co_t b = prepare();
+		size_t erased = 0;
+		for (auto it = b.begin(); it != b.end();)
+			if (it->number % 3 == 0)
+			{
+				it = b.erase(it);
+				++erased;
+			}
+			else
+				++it;
+		ASSERT_EQ(opCount.dtorCount, erased);
+
+		// Holes are skipped on the way, so live slots are destroyed once.
+		b.clear_keep_capacity();
+		ASSERT_EQ(opCount.dtorCount, 1000);
+
+		for (size_t i = 0; i < 100; ++i)
+			b.emplace(i);
+		for (auto it = b.begin(); it != b.end();)
+			it = it->number % 2 == 0 ? b.erase(it) : std::next(it);
+		opCount.clearCounters();
+	}
+	ASSERT_EQ(opCount.dtorCount, 50);
+}
+
+TEST(base, trivially_destructible_clear_and_reuse)
+{
+	static_assert(std::is_trivially_destructible_v< size_t >);
+	bs_sizet_t b(16);
+	for (size_t i = 0; i < 160; ++i)
+		b.insert(i);
+	for (auto it = b.begin(); it != b.end();)
+		it = *it % 2 == 0 ? b.erase(it) : std::next(it);
+
+	const size_t capacity = b.capacity();
+	b.clear_keep_capacity();
+	ASSERT_TRUE(b.empty());
+	ASSERT_EQ(b.begin(), b.end());
+	ASSERT_EQ(b.capacity(), capacity);
+
+	for (size_t i = 1000; i < 1160; ++i)
+		b.insert(i);
+	ASSERT_EQ(b.size(), 160);
+	ASSERT_EQ(b.capacity(), capacity);
+	ASSERT_EQ(std::accumulate(b.cbegin(), b.cend(), size_t(0)), 160 * 1000 + 159 * 80);
+
+	b.clear();
+	ASSERT_EQ(b.capacity(), 0);
+	for (size_t i = 0; i < 20; ++i)
+		b.insert(i);
+	ASSERT_EQ(std::accumulate(b.cbegin(), b.cend(), size_t(0)), 19 * 10);
+}
+
 TEST(base, iterating)
 {
 	bs_co_t b = prepare();
@@ -444,6 +526,1514 @@ TEST(iterators, member_of_pointer)
 	}
 }
 
+TEST(snapshot, shares_blocks)
+{
+	bs_co_t b = prepare();
+	size_t n = b.size();
+
+	bs_co_t::Snapshot snap = b.snapshot();
+	ASSERT_EQ(opCount, NO_OP);
+	ASSERT_EQ(snap.size(), n);
+
+	size_t sum = 0;
+	for (const CountedOperationObject &i : snap)
+		sum += i.number;
+	ASSERT_EQ(sum, n * (n - 1) / 2);
+	ASSERT_EQ(opCount, NO_OP);
+}
+
+TEST(snapshot, copy_on_write)
+{
+	bs_co_t b = prepare();
+	size_t n = b.size();
+	bs_co_t::Snapshot snap = b.snapshot();
+
+	b.erase(b.begin());
+	ASSERT_EQ(opCount, OpCount(0, 64, 0, 0, 0, 1));
+
+	opCount.clearCounters();
+	b.insert(CountedOperationObject(n));
+	(*b.begin()).number = n + 1;
+	ASSERT_EQ(opCount, OpCount(1, 0, 1, 0, 0, 1));
+
+	size_t sum = 0;
+	size_t counter = 0;
+	for (const CountedOperationObject &i : snap)
+	{
+		sum += i.number;
+		counter++;
+	}
+	ASSERT_EQ(counter, n);
+	ASSERT_EQ(sum, n * (n - 1) / 2);
+
+	opCount.clearCounters();
+	snap = bs_co_t::Snapshot();
+	ASSERT_EQ(opCount, OpCount(0, 0, 0, 0, 0, 64));
+}
+
+TEST(snapshot, stale_iterator_writes_live_block)
+{
+	bs_sizet_t b(16);
+	for (size_t i = 0; i < 32; ++i)
+		b.insert(i);
+
+	auto first = b.begin();
+	auto second = std::next(b.begin());
+	bs_sizet_t::const_iterator reader = std::next(b.cbegin(), 2);
+	bs_sizet_t::Snapshot snap = b.snapshot();
+
+	*first = 100;
+	*second = 200;
+	ASSERT_EQ(*reader, 2);
+	ASSERT_EQ(*std::next(b.begin()), 200);
+	ASSERT_EQ(*std::next(snap.begin()), 1);
+
+	snap = bs_sizet_t::Snapshot();
+	ASSERT_EQ(*++second, 2);
+	ASSERT_EQ(*b.begin(), 100);
+}
+
+TEST(snapshot, stale_iterator_erases_live_block)
+{
+	bs_sizet_t b(16);
+	for (size_t i = 0; i < 32; ++i)
+		b.insert(i);
+
+	auto first = b.begin();
+	auto second = std::next(b.begin());
+	{
+		bs_sizet_t::Snapshot snap = b.snapshot();
+		*first = 100;
+		auto next = b.erase(second);
+		ASSERT_EQ(*next, 2);
+
+		size_t sum = 0;
+		for (size_t i : snap)
+			sum += i;
+		ASSERT_EQ(sum, 31 * 32 / 2);
+	}
+
+	b.insert(300);
+	ASSERT_EQ(b.size(), 32);
+	size_t sum = 0;
+	for (size_t i : std::as_const(b))
+		sum += i;
+	ASSERT_EQ(sum, 31 * 32 / 2 - 1 + 100 + 300);
+}
+
+TEST(snapshot, reads_copy_only_through_mutable_references)
+{
+	bs_sizet_t b(16);
+	for (size_t i = 0; i < 160; ++i)
+		b.insert(i);
+	bs_sizet_t::Snapshot snap = b.snapshot();
+	const size_t allocations = b.stats().block_allocations;
+
+	size_t sum = 0;
+	for (const size_t& value : std::as_const(b))
+		sum += value;
+	ASSERT_EQ(sum, 159 * 80);
+	ASSERT_EQ(b.stats().block_allocations, allocations);
+
+	// A mutable reference may be written through, so each block it points
+	// into is copied once.
+	sum = 0;
+	for (size_t& value : b)
+		sum += value;
+	for (size_t& value : b)
+		sum += value;
+	ASSERT_EQ(sum, 159 * 160);
+	ASSERT_EQ(b.stats().block_allocations, allocations + 10);
+}
+
+TEST(snapshot, outlives_storage)
+{
+	bs_sizet_t::Snapshot snap;
+	{
+		bs_sizet_t b;
+		for (size_t i = 0; i < 200; ++i)
+			b.insert(i);
+		snap = b.snapshot();
+		b.clear();
+	}
+
+	size_t sum = 0;
+	for (size_t i : snap)
+		sum += i;
+	ASSERT_EQ(snap.size(), 200);
+	ASSERT_EQ(sum, 199 * 100);
+}
+
+TEST(handles, detect_stale_slot)
+{
+	bs_sizet_t b = bs_sizet_t(4);
+	bs_sizet_t::Handle first = b.handle(b.insert(1));
+	bs_sizet_t::Handle second = b.handle(b.insert(2));
+
+	ASSERT_EQ(*b.get(first), 1);
+	ASSERT_EQ(*b.get(second), 2);
+
+	b.erase(b.begin());
+	ASSERT_EQ(b.get(first), nullptr);
+	ASSERT_EQ(*b.get(second), 2);
+
+	bs_sizet_t::Handle reused = b.handle(b.insert(3));
+	ASSERT_EQ(reused.getBlock(), first.getBlock());
+	ASSERT_EQ(reused.getSlot(), first.getSlot());
+	ASSERT_NE(reused, first);
+	ASSERT_EQ(b.get(first), nullptr);
+	ASSERT_EQ(*b.get(reused), 3);
+	ASSERT_EQ(b.get(bs_sizet_t::Handle()), nullptr);
+}
+
+TEST(handles, detect_released_block)
+{
+	bs_sizet_t b = bs_sizet_t(2);
+	std::vector< bs_sizet_t::Handle > handles;
+	for (size_t i = 0; i < 6; ++i)
+		handles.push_back(b.handle(b.insert(i)));
+
+	b.erase(b.begin());
+	b.erase(b.begin());
+	ASSERT_EQ(b.get(handles[0]), nullptr);
+	ASSERT_EQ(b.get(handles[1]), nullptr);
+
+	for (size_t i = 0; i < 2; ++i)
+		b.insert(10 + i);
+	for (size_t i = 2; i < 6; ++i)
+		ASSERT_EQ(*b.get(handles[i]), i);
+	ASSERT_EQ(b.get(handles[0]), nullptr);
+
+	b.clear();
+	b.insert(0);
+	for (const bs_sizet_t::Handle &handle : handles)
+		ASSERT_EQ(b.get(handle), nullptr);
+}
+
+TEST(handles, follow_copy_on_write)
+{
+	bs_sizet_t b;
+	bs_sizet_t::Handle handle = b.handle(b.insert(5));
+	bs_sizet_t::Snapshot snap = b.snapshot();
+
+	*b.get(handle) = 6;
+	ASSERT_EQ(*b.get(handle), 6);
+	ASSERT_EQ(*snap.begin(), 5);
+
+	const bs_sizet_t &cb = b;
+	ASSERT_EQ(*cb.get(handle), 6);
+}
+
+TEST(serialization, raw_round_trip)
+{
+	bs_sizet_t b = bs_sizet_t(16);
+	for (size_t i = 0; i < 100; ++i)
+		b.insert(i);
+	for (bs_sizet_t::iterator it = b.begin(); it != b.end();)
+		it = *it % 3 == 0 ? b.erase(it) : std::next(it);
+
+	std::stringstream stream;
+	b.save(stream);
+
+	bs_sizet_t loaded;
+	loaded.load(stream);
+	ASSERT_EQ(loaded.size(), b.size());
+	ASSERT_EQ(loaded.capacity(), b.capacity());
+	ASSERT_TRUE(std::equal(b.cbegin(), b.cend(), loaded.cbegin()));
+
+	loaded.insert(1000);
+	ASSERT_EQ(loaded.capacity(), b.capacity());
+	ASSERT_EQ(loaded.size(), b.size() + 1);
+}
+
+TEST(serialization, custom_serializer)
+{
+	bs_string_t b;
+	for (size_t i = 0; i < 100; ++i)
+		b.insert(std::to_string(i));
+
+	std::stringstream stream;
+	b.save(stream, [](std::ostream &out, const std::string &value) { out << value << '\n'; });
+
+	bs_string_t loaded;
+	loaded.load(
+		stream,
+		[](std::istream &in)
+		{
+			std::string value;
+			std::getline(in, value);
+			return value;
+		});
+	ASSERT_EQ(loaded.size(), 100);
+	ASSERT_TRUE(std::equal(b.cbegin(), b.cend(), loaded.cbegin()));
+}
+
+TEST(serialization, rejects_bad_input)
+{
+	bs_sizet_t b;
+	for (size_t i = 0; i < 100; ++i)
+		b.insert(i);
+
+	std::stringstream stream;
+	b.save(stream);
+	std::string dump = stream.str();
+
+	bs_sizet_t loaded;
+	loaded.insert(7);
+
+	std::stringstream truncated(dump.substr(0, dump.size() - 1));
+	ASSERT_THROW(loaded.load(truncated), std::runtime_error);
+	ASSERT_EQ(loaded.size(), 1);
+
+	std::stringstream garbage("definitely not a dump");
+	ASSERT_THROW(loaded.load(garbage), std::runtime_error);
+	ASSERT_EQ(*loaded.begin(), 7);
+}
+
+TEST(mapped, reopen_without_reload)
+{
+	const std::string path = ::testing::TempDir() + "bucket_storage_mapped.bin";
+	size_t expected = 0;
+	{
+		MappedBucketStorage< size_t > b = MappedBucketStorage< size_t >::create(path, 16);
+		for (size_t i = 0; i < 1000; ++i)
+			b.insert(i);
+		ASSERT_EQ(b.capacity(), 1008);
+
+		for (auto it = b.begin(); it != b.end();)
+			it = *it % 2 == 0 ? b.erase(it) : std::next(it);
+		for (size_t i : b)
+			expected += i;
+		b.flush();
+	}
+
+	MappedBucketStorage< size_t > b = MappedBucketStorage< size_t >::open(path);
+	ASSERT_EQ(b.size(), 500);
+
+	size_t sum = 0;
+	for (auto it = b.cbegin(); it != b.cend(); ++it)
+		sum += *it;
+	ASSERT_EQ(sum, expected);
+
+	size_t backwards = 0;
+	auto it = b.end();
+	do
+	{
+		--it;
+		backwards += *it;
+	} while (it != b.begin());
+	ASSERT_EQ(backwards, expected);
+
+	for (size_t i = 0; i < 500; ++i)
+		b.insert(0);
+	ASSERT_EQ(b.size(), 1000);
+	ASSERT_EQ(b.capacity(), 1008);
+
+	b.clear();
+	ASSERT_TRUE(b.empty());
+	ASSERT_EQ(b.begin(), b.end());
+	std::remove(path.c_str());
+}
+
+TEST(mapped, rejects_foreign_files)
+{
+	const std::string path = ::testing::TempDir() + "bucket_storage_foreign.bin";
+	{
+		std::ofstream out(path, std::ios::binary);
+		out << "definitely not a storage, but long enough to hold a header of the mapped storage";
+	}
+	ASSERT_THROW(MappedBucketStorage< size_t >::open(path), std::runtime_error);
+
+	MappedBucketStorage< int >::create(path).insert(1);
+	ASSERT_THROW(MappedBucketStorage< size_t >::open(path), std::runtime_error);
+	ASSERT_EQ(*MappedBucketStorage< int >::open(path).begin(), 1);
+	std::remove(path.c_str());
+}
+
+TEST(mapped, rejects_corrupted_offsets)
+{
+	const std::string path = ::testing::TempDir() + "bucket_storage_corrupted.bin";
+	{
+		auto storage = MappedBucketStorage< size_t >::create(path, 16);
+		for (size_t i = 0; i < 40; ++i)
+			storage.insert(i);
+		storage.erase(storage.begin());
+	}
+
+	std::string bytes;
+	{
+		std::ifstream in(path, std::ios::binary);
+		bytes.assign(std::istreambuf_iterator< char >(in), std::istreambuf_iterator< char >());
+	}
+	std::uint64_t head = 0;
+	std::memcpy(&head, bytes.data() + 48, sizeof(head));
+
+	// head_block, tail_block, last_deleting and free_blocks of the header,
+	// then next, previous, used, first and last of the head block.
+	const std::pair< std::uint64_t, std::uint64_t > patches[] = {
+		{ 48, 1u << 30 },	{ 56, 1u << 30 },  { 64, 1u << 30 }, { 72, 1u << 30 }, { head, 1u << 30 },
+		{ head + 8, head }, { head + 40, 17 }, { head + 48, 16 }, { head + 56, 3 },
+	};
+	for (const auto& [field, value] : patches)
+	{
+		std::string corrupted = bytes;
+		corrupted.replace(static_cast< size_t >(field), sizeof(value), reinterpret_cast< const char* >(&value), sizeof(value));
+		const std::string corrupted_path = path + ".corrupted";
+		{
+			std::ofstream out(corrupted_path, std::ios::binary);
+			out << corrupted;
+		}
+		ASSERT_THROW(MappedBucketStorage< size_t >::open(corrupted_path), std::runtime_error) << field;
+		std::remove(corrupted_path.c_str());
+	}
+
+	ASSERT_EQ(MappedBucketStorage< size_t >::open(path).size(), 39);
+	std::remove(path.c_str());
+}
+
+TEST(mapped, readers_of_one_process_remap_once)
+{
+	const std::string name = "/bucket_storage_remap_" + std::to_string(::getpid());
+	MappedBucketStorage< size_t >::remove_shared(name);
+	MappedBucketStorage< size_t > producer = MappedBucketStorage< size_t >::create_shared(name, 16);
+	MappedBucketStorage< size_t > reader = MappedBucketStorage< size_t >::open_shared(name);
+
+	for (size_t round = 0; round < 20; ++round)
+	{
+		{
+			std::unique_lock lock(producer);
+			for (size_t i = 0; i < 500; ++i)
+				producer.insert(i);
+		}
+
+		std::vector< std::future< size_t > > sums;
+		for (size_t t = 0; t < 4; ++t)
+			sums.push_back(std::async(std::launch::async, [&reader] {
+				std::shared_lock lock(reader);
+				size_t sum = 0;
+				for (size_t i : std::as_const(reader))
+					sum += i;
+				return sum;
+			}));
+		for (auto& sum : sums)
+			ASSERT_EQ(sum.get(), (round + 1) * 499 * 500 / 2);
+	}
+	MappedBucketStorage< size_t >::remove_shared(name);
+}
+
+TEST(mapped, shared_across_processes)
+{
+	const std::string name = "/bucket_storage_test_" + std::to_string(::getpid());
+	MappedBucketStorage< size_t >::remove_shared(name);
+	MappedBucketStorage< size_t > producer = MappedBucketStorage< size_t >::create_shared(name, 16);
+	for (size_t i = 0; i < 100; ++i)
+		producer.insert(i);
+
+	int ready[2];
+	ASSERT_EQ(::pipe(ready), 0);
+
+	const pid_t child = ::fork();
+	ASSERT_GE(child, 0);
+	if (child == 0)
+	{
+		MappedBucketStorage< size_t > reader = MappedBucketStorage< size_t >::open_shared(name);
+		char signal = 0;
+		bool ok = ::read(ready[0], &signal, 1) == 1;
+
+		std::shared_lock lock(reader);
+		size_t sum = 0;
+		for (size_t i : reader)
+			sum += i;
+		ok = ok && reader.size() == 10000 && sum == 9999 * 5000;
+		::_exit(ok ? 0 : 1);
+	}
+
+	{
+		std::unique_lock lock(producer);
+		for (size_t i = 100; i < 10000; ++i)
+			producer.insert(i);
+	}
+	ASSERT_EQ(::write(ready[1], "x", 1), 1);
+
+	int status = 0;
+	ASSERT_EQ(::waitpid(child, &status, 0), child);
+	::close(ready[0]);
+	::close(ready[1]);
+	MappedBucketStorage< size_t >::remove_shared(name);
+
+	ASSERT_TRUE(WIFEXITED(status));
+	ASSERT_EQ(WEXITSTATUS(status), 0);
+}
+
+TEST(serialization, checkpoint_async)
+{
+	const std::string path = ::testing::TempDir() + "bucket_storage_checkpoint.bin";
+	bs_sizet_t b;
+	for (size_t i = 0; i < 10000; ++i)
+		b.insert(i);
+
+	std::future< void > checkpoint = b.checkpoint_async(path);
+	for (bs_sizet_t::iterator it = b.begin(); it != b.end();)
+		it = *it % 2 == 0 ? b.erase(it) : std::next(it);
+	for (size_t i = 0; i < 1000; ++i)
+		b.insert(i);
+	checkpoint.get();
+
+	bs_sizet_t loaded;
+	loaded.load(path);
+	ASSERT_EQ(loaded.size(), 10000);
+
+	size_t sum = 0;
+	for (size_t i : loaded)
+		sum += i;
+	ASSERT_EQ(sum, 9999 * 5000);
+	std::remove(path.c_str());
+
+	ASSERT_THROW(b.checkpoint_async(::testing::TempDir() + "missing/dir/file.bin").get(), std::runtime_error);
+}
+
+TEST(serialization, checkpoint_async_with_earlier_iterators)
+{
+	const std::string path = ::testing::TempDir() + "bucket_storage_checkpoint_iterators.bin";
+	bs_sizet_t b(16);
+	for (size_t i = 0; i < 10000; ++i)
+		b.insert(i);
+
+	// Pairs of iterators into one block: the first write copies the block,
+	// and the second iterator, taken before the checkpoint, must follow it.
+	std::vector< std::pair< bs_sizet_t::iterator, bs_sizet_t::iterator > > pairs;
+	for (bs_sizet_t::iterator it = b.begin(); std::distance(it, b.end()) > 160; std::advance(it, 160))
+		pairs.emplace_back(it, std::next(it));
+
+	std::future< void > checkpoint = b.checkpoint_async(path);
+	for (size_t i = 0; i < pairs.size(); ++i)
+	{
+		*pairs[i].first += 1000000;
+		if (i % 2 == 0)
+			*pairs[i].second += 1000000;
+		else
+			b.erase(pairs[i].second);
+	}
+	checkpoint.get();
+
+	bs_sizet_t loaded;
+	loaded.load(path);
+	ASSERT_EQ(loaded.size(), 10000);
+
+	size_t sum = 0;
+	for (size_t i : loaded)
+		sum += i;
+	ASSERT_EQ(sum, 9999 * 5000);
+	std::remove(path.c_str());
+
+	size_t expected = 9999 * 5000;
+	for (size_t i = 0; i < pairs.size(); ++i)
+		expected += i % 2 == 0 ? 2000000 : 1000000 - (i * 160 + 1);
+	ASSERT_EQ(b.size(), 10000 - pairs.size() / 2);
+	sum = 0;
+	for (size_t i : std::as_const(b))
+		sum += i;
+	ASSERT_EQ(sum, expected);
+}
+
+TEST(stats, occupancy_and_fragmentation)
+{
+	bs_sizet_t b(10);
+	for (size_t i = 0; i < 100; ++i)
+		b.insert(i);
+
+	bs_sizet_t::Stats stats = b.stats();
+	ASSERT_EQ(stats.block_count, 10);
+	ASSERT_EQ(stats.blocks.size(), 10);
+	ASSERT_EQ(stats.deleting_blocks, 0);
+	ASSERT_EQ(stats.fragmentation, 0.0);
+	ASSERT_EQ(stats.payload_bytes, 100 * sizeof(size_t));
+	ASSERT_GT(stats.metadata_bytes, 0);
+
+	for (bs_sizet_t::iterator it = b.begin(); it != b.end();)
+		it = *it % 2 == 0 && *it < 40 ? b.erase(it) : std::next(it);
+
+	stats = b.stats();
+	ASSERT_EQ(stats.size, 80);
+	ASSERT_EQ(stats.deleting_blocks, 4);
+	ASSERT_EQ(stats.blocks[0].live, 5);
+	ASSERT_EQ(stats.blocks[0].erased, 5);
+	ASSERT_EQ(stats.blocks[9].erased, 0);
+	ASSERT_DOUBLE_EQ(stats.fragmentation, 0.2);
+}
+
+TEST(stats, counts_block_lifetime)
+{
+	bs_sizet_t b(10);
+	for (size_t i = 0; i < 100; ++i)
+		b.insert(i);
+	for (bs_sizet_t::iterator it = b.begin(); it != b.end();)
+		it = *it < 30 ? b.erase(it) : std::next(it);
+
+	bs_sizet_t::Stats stats = b.stats();
+	ASSERT_EQ(stats.block_count, 7);
+	ASSERT_EQ(stats.block_allocations, 10);
+	ASSERT_EQ(stats.block_frees, 3);
+
+	b.shrink_to_fit();
+	stats = b.stats();
+	ASSERT_EQ(stats.block_count, 7);
+	ASSERT_EQ(stats.block_allocations - stats.block_frees, stats.block_count);
+	ASSERT_EQ(stats.block_allocations, 17);
+}
+
+struct TracingInstrumentation : CountingInstrumentation
+{
+	std::vector< StorageEvent > events;
+
+	void record(StorageEvent event, std::chrono::nanoseconds elapsed)
+	{
+		CountingInstrumentation::record(event, elapsed);
+		events.push_back(event);
+	}
+};
+
+TEST(instrumentation, disabled_by_default)
+{
+	static_assert(!NoInstrumentation::enabled);
+	static_assert(sizeof(BucketStorage< size_t >) < sizeof(BucketStorage< size_t, CountingInstrumentation >));
+}
+
+TEST(instrumentation, counts_hot_path)
+{
+	BucketStorage< size_t, CountingInstrumentation > b(10);
+	for (size_t i = 0; i < 25; ++i)
+		b.insert(i);
+
+	auto it = b.begin();
+	it = b.erase(it);
+	b.insert(100);
+	for (; it != b.end(); ++it)
+	{
+	}
+
+	const CountingInstrumentation& counters = b.instrumentation();
+	ASSERT_EQ(counters.getCount(StorageEvent::Insert), 26);
+	ASSERT_EQ(counters.getCount(StorageEvent::InsertInDeletedCell), 1);
+	ASSERT_EQ(counters.getCount(StorageEvent::Erase), 1);
+	ASSERT_EQ(counters.getCount(StorageEvent::AddBlock), 3);
+	ASSERT_EQ(counters.getCount(StorageEvent::DelBlock), 0);
+	ASSERT_EQ(counters.getCount(StorageEvent::BlockHop), 2);
+	ASSERT_GT(counters.getTime(StorageEvent::Insert).count(), 0);
+}
+
+TEST(instrumentation, calls_user_hooks)
+{
+	BucketStorage< size_t, TracingInstrumentation > b(2);
+	b.insert(1);
+	b.insert(2);
+	b.erase(b.begin());
+	b.erase(b.begin());
+
+	const std::vector< StorageEvent > expected = { StorageEvent::AddBlock, StorageEvent::Insert, StorageEvent::Insert,
+												   StorageEvent::Erase,	   StorageEvent::DelBlock, StorageEvent::Erase };
+	ASSERT_EQ(b.instrumentation().events, expected);
+}
+
+TEST(allocations, insert_into_hole_is_free)
+{
+	bs_sizet_t b(16);
+	std::vector< bs_sizet_t::iterator > iterators;
+	for (size_t i = 0; i < 64; ++i)
+		iterators.push_back(b.insert(i));
+	for (size_t i = 0; i < 64; i += 2)
+		b.erase(iterators[i]);
+
+	allocCount.clearCounters();
+	for (size_t i = 0; i < 32; ++i)
+		b.insert(i);
+	const size_t allocations = allocCount.allocations;
+	const size_t deallocations = allocCount.deallocations;
+
+	ASSERT_EQ(allocations, 0);
+	ASSERT_EQ(deallocations, 0);
+	ASSERT_EQ(b.size(), 64);
+}
+
+TEST(allocations, one_per_block)
+{
+	bs_sizet_t b(16);
+	for (size_t i = 0; i < 16 * 8; ++i)
+		b.insert(i);
+	b.clear();
+
+	allocCount.clearCounters();
+	for (size_t i = 0; i < 16 * 8; ++i)
+		b.insert(i);
+	const size_t fill_allocations = allocCount.allocations;
+
+	allocCount.clearCounters();
+	for (bs_sizet_t::iterator it = b.begin(); it != b.end();)
+		it = *it < 16 ? b.erase(it) : std::next(it);
+	const size_t erase_allocations = allocCount.allocations;
+	const size_t erase_deallocations = allocCount.deallocations;
+
+	allocCount.clearCounters();
+	bs_sizet_t::Snapshot snapshot = b.snapshot();
+	const size_t snapshot_allocations = allocCount.allocations;
+	allocCount.clearCounters();
+	b.erase(b.begin());
+	const size_t detach_allocations = allocCount.allocations;
+
+	ASSERT_EQ(fill_allocations, 8);
+	ASSERT_EQ(erase_allocations, 0);
+	ASSERT_EQ(erase_deallocations, 1);
+	ASSERT_EQ(snapshot_allocations, 1);
+	ASSERT_EQ(detach_allocations, 1);
+}
+
+TEST(allocations, empty_storage_allocates_nothing)
+{
+	allocCount.clearCounters();
+	{
+		bs_sizet_t a;
+		bs_sizet_t b(16, 256);
+		bs_sizet_t c = std::move(a);
+		b = std::move(c);
+		std::swap(a, b);
+		ASSERT_EQ(a.capacity(), 0);
+		ASSERT_EQ(a.stats().block_count, 0);
+		ASSERT_EQ(a.begin(), a.end());
+	}
+	ASSERT_EQ(allocCount.allocations, 0);
+
+	bs_sizet_t b(16);
+	b.insert(1);
+	bs_sizet_t target;
+	allocCount.clearCounters();
+	target = std::move(b);
+	ASSERT_EQ(allocCount.allocations, 0);
+	ASSERT_EQ(*target.begin(), 1);
+	ASSERT_TRUE(b.empty());
+	b.insert(2);
+	ASSERT_EQ(*b.begin(), 2);
+}
+
+TEST(allocations, copy_clones_blocks)
+{
+	bs_sizet_t b(16);
+	std::vector< bs_sizet_t::Handle > handles;
+	for (size_t i = 0; i < 16 * 8; ++i)
+		handles.push_back(b.handle(b.insert(i)));
+	for (bs_sizet_t::iterator it = b.begin(); it != b.end();)
+		it = *it % 3 == 0 ? b.erase(it) : std::next(it);
+
+	allocCount.clearCounters();
+	bs_sizet_t copy = b;
+	const size_t copy_allocations = allocCount.allocations;
+
+	ASSERT_EQ(copy_allocations, 8 + 1);
+	ASSERT_EQ(copy.stats().block_count, b.stats().block_count);
+	ASSERT_EQ(copy.stats().fragmentation, b.stats().fragmentation);
+	ASSERT_EQ(copy.capacity(), b.capacity());
+	ASSERT_TRUE(std::equal(copy.begin(), copy.end(), b.begin(), b.end()));
+	for (size_t i = 0; i < handles.size(); ++i)
+		ASSERT_EQ(copy.get(handles[i]) ? *copy.get(handles[i]) : 0, b.get(handles[i]) ? *b.get(handles[i]) : 0);
+
+	for (size_t i = 0; i < 16 * 3; ++i)
+	{
+		b.insert(i);
+		copy.insert(i);
+	}
+	ASSERT_TRUE(std::equal(copy.begin(), copy.end(), b.begin(), b.end()));
+}
+
+TEST(allocations, refill_after_clear_keep_capacity)
+{
+	bs_sizet_t b(16);
+	for (size_t i = 0; i < 16 * 8; ++i)
+		b.insert(i);
+	bs_sizet_t::Handle handle = b.handle(b.begin());
+	const size_t capacity = b.capacity();
+
+	allocCount.clearCounters();
+	b.clear_keep_capacity();
+	ASSERT_TRUE(b.empty());
+	ASSERT_EQ(b.begin(), b.end());
+	ASSERT_EQ(b.capacity(), capacity);
+	ASSERT_EQ(b.get(handle), nullptr);
+
+	for (size_t i = 0; i < 16 * 8; ++i)
+		b.insert(i + 1000);
+	const size_t refill_allocations = allocCount.allocations;
+	const size_t refill_deallocations = allocCount.deallocations;
+
+	ASSERT_EQ(refill_allocations, 0);
+	ASSERT_EQ(refill_deallocations, 0);
+	ASSERT_EQ(b.capacity(), capacity);
+	ASSERT_EQ(b.stats().block_count, 8);
+	size_t expected = 1000;
+	for (size_t value : b)
+		ASSERT_EQ(value, expected++);
+
+	b.insert(0);
+	ASSERT_EQ(b.stats().block_count, 9);
+}
+
+TEST(allocations, clear_keep_capacity_with_snapshot)
+{
+	bs_sizet_t b(16);
+	for (size_t i = 0; i < 16 * 4; ++i)
+		b.insert(i);
+	bs_sizet_t::Snapshot snapshot = b.snapshot();
+	b.erase(b.begin());
+
+	b.clear_keep_capacity();
+	ASSERT_EQ(b.capacity(), 16);
+	ASSERT_EQ(std::distance(snapshot.begin(), snapshot.end()), 16 * 4);
+
+	for (size_t i = 0; i < 40; ++i)
+		b.insert(i);
+	ASSERT_TRUE(std::equal(b.begin(), b.end(), snapshot.begin(), std::next(snapshot.begin(), 40)));
+}
+
+TEST(trace, record_and_replay)
+{
+	BucketStorage< size_t, TraceRecorder > b(8);
+	size_t next = 0;
+	for (; next < 200; ++next)
+		b.insert(next);
+	for (auto it = b.begin(); it != b.end();)
+		it = *it % 3 == 0 ? b.erase(it) : std::next(it);
+	b.shrink_to_fit();
+	for (auto it = b.begin(); it != b.end();)
+		it = *it % 5 == 0 ? b.erase(it) : std::next(it);
+	for (; next < 300; ++next)
+		b.insert(next);
+
+	std::stringstream stream;
+	b.instrumentation().getTrace().save(stream);
+	Trace trace;
+	trace.load(stream);
+	ASSERT_EQ(trace.getInsertCount(), 300);
+	ASSERT_LT(trace.size(), 2 * 500);
+
+	bs_sizet_t replayed(3);
+	const ReplayResult result = replay(trace, replayed);
+	ASSERT_EQ(result.operations, 300 + 67 + 26 + 2 + 1);
+
+	std::vector< size_t > expected(b.begin(), b.end());
+	std::vector< size_t > actual(replayed.begin(), replayed.end());
+	std::sort(expected.begin(), expected.end());
+	std::sort(actual.begin(), actual.end());
+	ASSERT_EQ(expected, actual);
+}
+
+TEST(growth, doubles_up_to_max)
+{
+	ASSERT_THROW(bs_sizet_t(0, 8), std::invalid_argument);
+	ASSERT_THROW(bs_sizet_t(16, 8), std::invalid_argument);
+
+	bs_sizet_t b(4, 32);
+	for (size_t i = 0; i < 100; ++i)
+		b.insert(i);
+	ASSERT_EQ(b.capacity(), 128);
+
+	std::vector< size_t > capacities;
+	for (const bs_sizet_t::BlockStats& block : b.stats().blocks)
+		capacities.push_back(block.capacity);
+	ASSERT_EQ(capacities, std::vector< size_t >({ 4, 4, 8, 16, 32, 32, 32 }));
+
+	for (auto it = b.begin(); it != b.end();)
+		it = *it >= 8 && *it < 16 ? b.erase(it) : std::next(it);
+	ASSERT_EQ(b.capacity(), 120);
+	ASSERT_EQ(b.size(), 92);
+
+	size_t sum = 0;
+	for (auto it = b.end(); it != b.begin();)
+		sum += *--it;
+	ASSERT_EQ(sum, 99 * 50 - (8 + 15) * 4);
+}
+
+TEST(growth, survives_copy_shrink_and_dump)
+{
+	bs_sizet_t b(2, 64);
+	for (size_t i = 0; i < 500; ++i)
+		b.insert(i);
+	for (auto it = b.begin(); it != b.end();)
+		it = *it % 4 != 0 ? b.erase(it) : std::next(it);
+
+	bs_sizet_t copy = b;
+	ASSERT_EQ(copy.size(), 125);
+	ASSERT_EQ(copy.capacity(), b.capacity());
+
+	b.shrink_to_fit();
+	ASSERT_EQ(b.size(), 125);
+	ASSERT_EQ(b.capacity(), 128);
+
+	std::stringstream stream;
+	b.save(stream);
+	bs_sizet_t loaded;
+	loaded.load(stream);
+	ASSERT_EQ(loaded.capacity(), b.capacity());
+	ASSERT_TRUE(std::equal(loaded.begin(), loaded.end(), b.begin(), b.end()));
+
+	for (size_t i = 0; i < 500; ++i)
+		loaded.insert(i);
+	ASSERT_EQ(loaded.stats().blocks.back().capacity, 64);
+}
+
+struct HugePageRecord
+{
+	char bytes[1024];
+};
+
+template<>
+struct BlockSizeTraits< HugePageRecord >
+{
+	static constexpr std::size_t target_bytes = 2 << 20;
+	static constexpr std::size_t min_capacity = 1;
+};
+
+TEST(growth, default_capacity_tracks_value_size)
+{
+	struct Record
+	{
+		char bytes[1024];
+	};
+
+	static_assert(bs_sizet_t::default_block_capacity == 64);
+	static_assert(BucketStorage< char >::default_block_capacity == 128);
+	static_assert(BucketStorage< Record >::default_block_capacity == 16);
+	static_assert(BucketStorage< HugePageRecord >::default_block_capacity == 1024);
+
+	BucketStorage< Record > b;
+	b.insert(Record{});
+	ASSERT_EQ(b.capacity(), 16);
+}
+
+TEST(reuse, fullest_block_first)
+{
+	bs_sizet_t b(8);
+	ASSERT_EQ(b.reuse_policy(), ReusePolicy::Lifo);
+	b.set_reuse_policy(ReusePolicy::FullestBlockFirst);
+
+	for (size_t i = 0; i < 32; ++i)
+		b.insert(i);
+	for (auto it = b.begin(); it != b.end();)
+		it = (*it >= 1 && *it < 8) || *it == 8 || *it == 9 || *it == 31 ? b.erase(it) : std::next(it);
+
+	for (size_t i = 0; i < 3; ++i)
+		b.insert(100 + i);
+
+	std::vector< size_t > live;
+	for (const bs_sizet_t::BlockStats& block : b.stats().blocks)
+		live.push_back(block.live);
+	ASSERT_EQ(live, std::vector< size_t >({ 1, 8, 8, 8 }));
+
+	b.erase(b.begin());
+	ASSERT_EQ(b.stats().block_count, 3);
+	ASSERT_EQ(b.size(), 24);
+}
+
+TEST(reuse, memory_comes_back_after_spike)
+{
+	auto churn = [](ReusePolicy policy)
+	{
+		std::mt19937 random(7);
+		bs_sizet_t b(64);
+		b.set_reuse_policy(policy);
+		std::vector< bs_sizet_t::iterator > elements;
+		for (size_t i = 0; i < 20000; ++i)
+			elements.push_back(b.insert(i));
+
+		auto erase_random = [&]
+		{
+			const size_t index = random() % elements.size();
+			b.erase(elements[index]);
+			elements[index] = elements.back();
+			elements.pop_back();
+		};
+		while (elements.size() > 2000)
+			erase_random();
+		for (size_t i = 0; i < 100000; ++i)
+		{
+			erase_random();
+			elements.push_back(b.insert(i));
+		}
+		return b.stats().block_count;
+	};
+
+	ASSERT_LT(churn(ReusePolicy::FullestBlockFirst) * 2, churn(ReusePolicy::Lifo));
+}
+
+TEST(compaction, bounded_steps_keep_handles)
+{
+	bs_sizet_t b(16);
+	std::map< size_t, bs_sizet_t::Handle > handles;
+	for (size_t i = 0; i < 320; ++i)
+		b.insert(i);
+	for (auto it = b.begin(); it != b.end();)
+		it = *it % 4 != 0 ? b.erase(it) : std::next(it);
+	for (auto it = b.begin(); it != b.end(); ++it)
+		handles[*it] = b.handle(it);
+	const size_t blocks = b.stats().block_count;
+
+	std::vector< bs_sizet_t::Handle > stale;
+	auto on_move = [&](bs_sizet_t::Handle from, bs_sizet_t::Handle to)
+	{
+		ASSERT_EQ(handles[*b.get(to)], from);
+		handles[*b.get(to)] = to;
+		stale.push_back(from);
+	};
+
+	size_t steps = 0;
+	size_t moved = 0;
+	while (size_t step = b.compact_step(3, on_move))
+	{
+		ASSERT_LE(step, 3);
+		moved += step;
+		++steps;
+	}
+	ASSERT_EQ(moved, stale.size());
+	ASSERT_GT(steps, 10);
+	ASSERT_EQ(b.size(), 80);
+	ASSERT_LE(b.stats().block_count, blocks / 4 + 1);
+
+	for (const auto& [value, handle] : handles)
+		ASSERT_EQ(*b.get(handle), value);
+	for (const auto& handle : stale)
+		ASSERT_EQ(b.get(handle), nullptr);
+}
+
+TEST(compaction, drains_block_with_most_holes)
+{
+	bs_sizet_t b(8);
+	b.set_reuse_policy(ReusePolicy::FullestBlockFirst);
+	for (size_t i = 0; i < 64; ++i)
+		b.insert(i);
+	// One hole in each block but the sixth, which keeps two elements.
+	for (auto it = b.begin(); it != b.end();)
+		it = *it % 8 == 0 || (*it / 8 == 5 && *it % 8 < 6) ? b.erase(it) : std::next(it);
+
+	std::vector< size_t > moved;
+	b.compact_step(2, [&](bs_sizet_t::Handle, bs_sizet_t::Handle to) { moved.push_back(*b.get(to)); });
+	ASSERT_EQ(moved, (std::vector< size_t >{ 46, 47 }));
+	ASSERT_EQ(b.stats().block_count, 7);
+}
+
+TEST(compaction, recorded_in_trace)
+{
+	BucketStorage< size_t, TraceRecorder > b(8);
+	for (size_t i = 0; i < 64; ++i)
+		b.insert(i);
+	for (auto it = b.begin(); it != b.end();)
+		it = *it % 2 != 0 ? b.erase(it) : std::next(it);
+	b.compact_step(100, [](auto, auto) {});
+	for (auto it = b.begin(); it != b.end();)
+		it = *it % 3 == 0 ? b.erase(it) : std::next(it);
+	ASSERT_EQ(b.instrumentation().getCount(StorageEvent::Compact), 1);
+
+	bs_sizet_t replayed(8);
+	replay(b.instrumentation().getTrace(), replayed);
+	std::vector< size_t > expected(b.begin(), b.end());
+	std::vector< size_t > actual(replayed.begin(), replayed.end());
+	std::sort(expected.begin(), expected.end());
+	std::sort(actual.begin(), actual.end());
+	ASSERT_EQ(expected, actual);
+}
+
+struct InlineName
+{
+	std::string name;
+};
+
+template<>
+struct BlockSizeTraits< InlineName >
+{
+	static constexpr std::size_t target_bytes = 4096;
+	static constexpr std::size_t min_capacity = 16;
+	static constexpr std::size_t inline_capacity = 4;
+};
+
+using bs_inline_t = BucketStorage< InlineName >;
+
+TEST(inline_block, small_storage_skips_block_allocation)
+{
+	allocCount.clearCounters();
+	{
+		bs_inline_t b;
+		for (size_t i = 0; i < 4; ++i)
+			b.insert(InlineName{ "n" });
+		ASSERT_EQ(b.capacity(), 4);
+	}
+	const size_t inline_allocations = allocCount.allocations;
+
+	allocCount.clearCounters();
+	bs_inline_t b;
+	for (size_t i = 0; i < 5; ++i)
+		b.insert(InlineName{ "n" });
+	const size_t overflow_allocations = allocCount.allocations;
+	ASSERT_EQ(b.capacity(), 4 + bs_inline_t::default_block_capacity);
+	ASSERT_EQ(b.stats().block_count, 2);
+
+	ASSERT_EQ(inline_allocations, 1);
+	ASSERT_EQ(overflow_allocations, 1 + 1 + 1);
+}
+
+TEST(inline_block, survives_move_swap_copy_and_snapshot)
+{
+	auto names = [](const bs_inline_t& b)
+	{
+		std::vector< std::string > result;
+		for (const InlineName& value : b)
+			result.push_back(value.name);
+		return result;
+	};
+
+	bs_inline_t a;
+	std::vector< bs_inline_t::Handle > handles;
+	for (size_t i = 0; i < 10; ++i)
+		handles.push_back(a.handle(a.insert(InlineName{ std::string(40, char('a' + i)) })));
+	a.erase(std::next(a.begin()));
+	const std::vector< std::string > expected = names(a);
+
+	bs_inline_t b = std::move(a);
+	ASSERT_EQ(names(b), expected);
+	ASSERT_EQ(b.get(handles[0])->name, expected[0]);
+	ASSERT_EQ(b.get(handles[1]), nullptr);
+
+	bs_inline_t c;
+	c.insert(InlineName{ "c" });
+	b.swap(c);
+	ASSERT_EQ(names(c), expected);
+	ASSERT_EQ(names(b), std::vector< std::string >{ "c" });
+
+	bs_inline_t::Snapshot snapshot = c.snapshot();
+	bs_inline_t copy = c;
+	c.clear();
+	ASSERT_EQ(names(copy), expected);
+	ASSERT_EQ(copy.get(handles[2])->name, expected[1]);
+	ASSERT_TRUE(std::equal(snapshot.begin(), snapshot.end(), expected.begin(), expected.end(), [](const InlineName& value, const std::string& name) { return value.name == name; }));
+
+	copy.insert(InlineName{ "x" });
+	ASSERT_EQ(copy.size(), expected.size() + 1);
+}
+
+TEST(merge, steals_blocks_without_copies)
+{
+	bs_co_t a = prepare();
+	bs_co_t b = prepare();
+	const size_t n = a.size();
+	bs_co_t::Handle kept = a.handle(a.begin());
+	a.erase(std::next(a.begin()));
+	b.erase(b.begin());
+	bs_co_t::iterator moved = b.begin();
+
+	opCount.clearCounters();
+	a.merge(std::move(b));
+	ASSERT_EQ(opCount, NO_OP);
+
+	ASSERT_EQ(a.size(), 2 * n - 2);
+	ASSERT_TRUE(b.empty());
+	ASSERT_EQ(b.capacity(), 0);
+	ASSERT_EQ(a.get(kept)->number, 0);
+	ASSERT_EQ(moved->number, 1);
+	ASSERT_EQ(std::distance(a.begin(), a.end()), 2 * n - 2);
+
+	a.insert(CountedOperationObject(7));
+	a.insert(CountedOperationObject(8));
+	ASSERT_EQ(a.stats().deleting_blocks, 0);
+	b.insert(CountedOperationObject(9));
+	ASSERT_EQ(b.size(), 1);
+}
+
+TEST(merge, mixed_capacities_round_trip)
+{
+	bs_sizet_t a(8);
+	bs_sizet_t b(32, 128);
+	for (size_t i = 0; i < 20; ++i)
+		a.insert(i);
+	for (size_t i = 20; i < 300; ++i)
+		b.insert(i);
+
+	a.merge(std::move(b));
+	size_t expected = 0;
+	for (size_t value : a)
+		ASSERT_EQ(value, expected++);
+	ASSERT_EQ(expected, 300);
+
+	std::stringstream stream;
+	a.save(stream);
+	bs_sizet_t loaded;
+	loaded.load(stream);
+	ASSERT_EQ(loaded.capacity(), a.capacity());
+	ASSERT_TRUE(std::equal(loaded.begin(), loaded.end(), a.begin(), a.end()));
+}
+
+TEST(split, extract_blocks_moves_whole_blocks)
+{
+	bs_co_t b = prepare();
+	const size_t n = b.size();
+	b.erase(b.begin());
+
+	opCount.clearCounters();
+	bs_co_t middle = b.extract_blocks(2, 5);
+	ASSERT_EQ(opCount, NO_OP);
+	ASSERT_EQ(middle.size(), 3 * 64);
+	ASSERT_EQ(b.size(), n - 1 - 3 * 64);
+	ASSERT_EQ(middle.begin()->number, 2 * 64);
+	ASSERT_EQ(std::next(b.begin(), 2 * 64 - 1)->number, 5 * 64);
+	ASSERT_THROW(b.extract_blocks(3, b.stats().block_count + 1), std::out_of_range);
+
+	std::vector< bs_co_t > parts = b.split(4);
+	ASSERT_TRUE(b.empty());
+	ASSERT_EQ(parts.size(), 4);
+	const size_t left = n - 1 - 3 * 64;
+	size_t total = 0;
+	for (const bs_co_t& part : parts)
+	{
+		ASSERT_GE(part.size(), left / 4 - 64);
+		ASSERT_LE(part.size(), left / 4 + 64);
+		total += part.size();
+	}
+	ASSERT_EQ(total, left);
+	ASSERT_EQ(opCount, NO_OP);
+}
+
+TEST(split, partition_moves_mixed_blocks_only)
+{
+	bs_co_t b = prepare();
+	const size_t n = b.size();
+
+	opCount.clearCounters();
+	bs_co_t low = b.partition([](const CountedOperationObject& value) { return value.number < 64 * 3 || value.number % 2 == 0; });
+	const OpCount moves = opCount;
+
+	ASSERT_EQ(moves.mtorCount, (n - 64 * 3) / 2);
+	ASSERT_EQ(moves.ctorCount, 0);
+	ASSERT_EQ(low.size(), 64 * 3 + (n - 64 * 3) / 2);
+	ASSERT_EQ(b.size(), n - low.size());
+	for (const CountedOperationObject& value : b)
+		ASSERT_EQ(value.number % 2, 1);
+	ASSERT_EQ(low.begin()->number, 0);
+
+	bs_co_t none = b.partition([](const CountedOperationObject&) { return false; });
+	ASSERT_TRUE(none.empty());
+	ASSERT_EQ(b.size(), n - low.size());
+}
+
+TEST(object_pool, handles_return_objects)
+{
+	static_assert(!std::is_copy_constructible_v< ObjectPool< std::string >::Handle >);
+	static_assert(std::is_nothrow_move_constructible_v< ObjectPool< std::string >::Handle >);
+
+	ObjectPool< std::string > pool;
+	auto first = pool.acquire("first");
+	ObjectPool< std::string >::Handle second = pool.acquire(3, 'x');
+	ASSERT_EQ(*first, "first");
+	ASSERT_EQ(*second, "xxx");
+	ASSERT_EQ(pool.size(), 2);
+
+	ObjectPool< std::string >::Handle moved = std::move(first);
+	ASSERT_FALSE(first);
+	ASSERT_EQ(moved->size(), 5);
+	moved.reset();
+	ASSERT_EQ(pool.size(), 1);
+
+	const std::string* reused = pool.acquire("third").get();
+	ASSERT_NE(reused, nullptr);
+	ASSERT_EQ(pool.size(), 1);
+}
+
+TEST(object_pool, cache_reuses_released_slots)
+{
+	ObjectPool< CountedOperationObject > pool(4);
+	const CountedOperationObject* address = nullptr;
+	opCount.clearCounters();
+	{
+		auto handle = pool.acquire(1);
+		address = handle.get();
+	}
+	ASSERT_EQ(pool.size(), 0);
+	ASSERT_EQ(opCount, OpCount(1, 0, 0, 0, 0, 1));
+
+	// The freed slot is reused and the new object is built in place.
+	auto handle = pool.acquire(2);
+	ASSERT_EQ(handle.get(), address);
+	ASSERT_EQ(handle->number, 2);
+	ASSERT_EQ(opCount, OpCount(2, 0, 0, 0, 0, 1));
+
+	handle.reset();
+	ASSERT_EQ(opCount.dtorCount, 2);
+	pool.trim();
+	ASSERT_EQ(pool.size(), 0);
+	ASSERT_EQ(opCount.dtorCount, 2);
+}
+
+TEST(object_pool, failed_construction_keeps_slot)
+{
+	struct Throwing
+	{
+		explicit Throwing(bool fail)
+		{
+			if (fail)
+				throw std::runtime_error("construction failed");
+		}
+	};
+
+	ObjectPool< Throwing > pool(2);
+	const Throwing* address = pool.acquire(false).get();
+	ASSERT_THROW(pool.acquire(true), std::runtime_error);
+	ASSERT_EQ(pool.size(), 0);
+	ASSERT_EQ(pool.acquire(false).get(), address);
+}
+
+TEST(object_pool, concurrent_acquire_release)
+{
+	ObjectPool< size_t > pool(8, 16);
+	std::vector< std::future< void > > workers;
+	for (size_t t = 0; t < 4; ++t)
+		workers.push_back(std::async(std::launch::async, [&pool, t] {
+			std::vector< ObjectPool< size_t >::Handle > held;
+			for (size_t i = 0; i < 2000; ++i)
+			{
+				held.push_back(pool.acquire(t * 10000 + i));
+				if (held.size() > 20)
+				{
+					ASSERT_EQ(*held.front() / 10000, t);
+					held.erase(held.begin());
+				}
+			}
+		}));
+	for (auto& worker : workers)
+		worker.get();
+
+	ASSERT_EQ(pool.size(), 0);
+	pool.trim();
+}
+
+TEST(bounds, size_limit_evicts_oldest_blocks)
+{
+	bs_sizet_t b(16);
+	std::map< size_t, bs_sizet_t::Handle > index;
+	std::vector< size_t > evicted;
+	b.set_bounds(40, 0, [&](const bs_sizet_t::Handle& handle, const size_t& value) {
+		ASSERT_EQ(b.get(handle), &value);
+		evicted.push_back(value);
+		index.erase(value);
+	});
+
+	for (size_t i = 0; i < 100; ++i)
+	{
+		index[i] = b.handle(b.insert(i));
+		ASSERT_LE(b.size(), 40);
+	}
+
+	std::vector< size_t > expected(64);
+	std::iota(expected.begin(), expected.end(), 0);
+	ASSERT_EQ(evicted, expected);
+	ASSERT_EQ(b.size(), 36);
+	ASSERT_EQ(b.stats().block_count, 3);
+	ASSERT_EQ(index.size(), b.size());
+	for (const auto& [value, handle] : index)
+		ASSERT_EQ(*b.get(handle), value);
+}
+
+TEST(bounds, byte_limit_with_kept_blocks)
+{
+	bs_sizet_t b(16, 64);
+	ASSERT_THROW(b.set_bounds(0, 8), std::invalid_argument);
+
+	const size_t budget = 3 * Block< size_t >::allocationSize(64);
+	b.set_bounds(0, budget);
+	for (size_t i = 0; i < 1000; ++i)
+	{
+		b.insert(i);
+		ASSERT_LE(b.stats().block_bytes, budget);
+	}
+	size_t next = 1000 - b.size();
+	for (size_t value : b)
+		ASSERT_EQ(value, next++);
+
+	const size_t capacity = b.capacity();
+	const size_t allocations = b.stats().block_allocations;
+	b.clear_keep_capacity();
+	for (size_t i = 0; i < capacity; ++i)
+		b.insert(i);
+	ASSERT_EQ(b.size(), capacity);
+	ASSERT_EQ(b.stats().block_allocations, allocations);
+
+	const size_t head = b.stats().blocks.front().capacity;
+	b.insert(capacity);
+	ASSERT_EQ(b.size(), capacity - head + 1);
+	ASSERT_EQ(*b.begin(), head);
+	ASSERT_LE(b.stats().block_bytes, budget);
+}
+
+TEST(bounds, evicts_embedded_block)
+{
+	const size_t limit = bs_inline_t::default_block_capacity;
+	bs_inline_t b;
+	size_t evicted = 0;
+	b.set_bounds(limit, 0, [&](const bs_inline_t::Handle&, const InlineName&) { ++evicted; });
+
+	for (size_t i = 0; i < 1000; ++i)
+	{
+		b.insert(InlineName{ std::to_string(i) });
+		ASSERT_LE(b.size(), limit);
+	}
+	ASSERT_EQ(evicted + b.size(), 1000);
+	size_t next = 1000 - b.size();
+	for (const InlineName& value : b)
+		ASSERT_EQ(value.name, std::to_string(next++));
+
+	bs_inline_t moved(std::move(b));
+	moved.insert(InlineName{ "last" });
+	ASSERT_LE(moved.size(), limit);
+}
+
+TEST(bounds, size_limit_below_one_block)
+{
+	bs_sizet_t b(64);
+	ASSERT_THROW(b.set_bounds(10), std::invalid_argument);
+	ASSERT_THROW(bs_inline_t().set_bounds(bs_inline_t::default_block_capacity - 1), std::invalid_argument);
+
+	b.set_bounds(64);
+	for (size_t i = 0; i < 65; ++i)
+		b.insert(i);
+	ASSERT_EQ(b.size(), 1);
+	ASSERT_EQ(b.stats().block_allocations, 2);
+
+	// A failed call leaves the earlier limits in place.
+	ASSERT_THROW(b.set_bounds(63), std::invalid_argument);
+	for (size_t i = 65; i < 128; ++i)
+		b.insert(i);
+	ASSERT_EQ(b.size(), 64);
+	b.insert(128);
+	ASSERT_EQ(b.size(), 1);
+}
+
+TEST(bounds, insert_of_element_about_to_be_evicted)
+{
+	const std::string prefix(32, 'x');
+	bs_string_t b(4);
+	b.set_bounds(8);
+	size_t next = 0;
+	// Each call copies the front element, which lives in the head block that
+	// the insert evicts from the full storage.
+	auto check = [&](auto&& insert)
+	{
+		while (b.size() < 8)
+			b.insert(prefix + std::to_string(next++));
+		const std::string front = *b.begin();
+		insert();
+		ASSERT_EQ(b.size(), 5);
+		ASSERT_EQ(*std::prev(b.end()), front);
+	};
+	check([&] { b.insert(*b.begin()); });
+	check([&] { b.emplace(*b.begin()); });
+	check([&] { b.emplace(b.begin()->c_str()); });
+
+	bs_string_t bytes(4, 4);
+	bytes.set_bounds(0, 2 * Block< std::string >::allocationSize(4));
+	for (size_t i = 0; i < 8; ++i)
+		bytes.insert(prefix + std::to_string(i));
+	bytes.insert(*bytes.begin());
+	ASSERT_EQ(bytes.size(), 5);
+	ASSERT_EQ(*bytes.begin(), prefix + "4");
+	ASSERT_EQ(*std::prev(bytes.end()), prefix + "0");
+}
+
+TEST(expiry, drops_whole_expired_blocks)
+{
+	using namespace std::chrono_literals;
+	const bs_sizet_t::time_point start{};
+
+	bs_sizet_t b(16);
+	size_t evicted = 0;
+	b.set_bounds(0, 0, [&](const bs_sizet_t::Handle&, const size_t&) { ++evicted; });
+	for (size_t tick = 0; tick < 10; ++tick)
+	{
+		b.set_insert_time(start + tick * 1s);
+		for (size_t i = 0; i < 16; ++i)
+			b.insert(tick * 16 + i);
+	}
+
+	ASSERT_EQ(b.expire_older_than(start), 0);
+	ASSERT_EQ(b.expire_older_than(start + 5s), 80);
+	ASSERT_EQ(evicted, 80);
+	ASSERT_EQ(b.size(), 80);
+	ASSERT_EQ(*b.begin(), 80);
+	ASSERT_EQ(b.stats().block_count, 5);
+
+	b.shrink_to_fit();
+	ASSERT_EQ(b.expire_older_than(start + 7s), 32);
+	ASSERT_EQ(*b.begin(), 112);
+}
+
+TEST(expiry, stamps_only_once_enabled)
+{
+	using namespace std::chrono_literals;
+	bs_sizet_t b(16);
+	for (size_t i = 0; i < 32; ++i)
+		b.insert(i);
+	ASSERT_FALSE(b.expiry_enabled());
+	ASSERT_EQ(b.begin().getCurrentBlock()->getNewest(), bs_sizet_t::time_point{});
+	ASSERT_THROW(b.expire_older_than(std::chrono::steady_clock::now()), std::logic_error);
+
+	// Elements stored before count as inserted when expiry is enabled.
+	const auto before = std::chrono::steady_clock::now();
+	b.enable_expiry();
+	for (size_t i = 32; i < 64; ++i)
+		b.insert(i);
+	ASSERT_TRUE(b.expiry_enabled());
+	ASSERT_GE(b.begin().getCurrentBlock()->getOldest(), before);
+	ASSERT_EQ(b.expire_older_than(before), 0);
+	ASSERT_EQ(b.size(), 64);
+
+	// A manual clock overrides steady_clock until it is reset.
+	b.set_insert_time(before + 1h);
+	b.insert(64);
+	ASSERT_EQ(b.insert_time(), before + 1h);
+	b.reset_insert_time();
+	ASSERT_LT(b.insert_time(), before + 1h);
+
+	ASSERT_EQ(b.expire_older_than(std::chrono::steady_clock::now() + 1s), 64);
+	ASSERT_EQ(b.size(), 1);
+	ASSERT_EQ(*b.begin(), 64);
+}
+
+TEST(expiry, checks_only_straddling_blocks)
+{
+	using namespace std::chrono_literals;
+	const bs_sizet_t::time_point start{};
+
+	bs_sizet_t b(16);
+	for (size_t tick = 0; tick < 8; ++tick)
+	{
+		b.set_insert_time(start + tick * 1s);
+		for (size_t i = 0; i < 8; ++i)
+			b.insert(tick);
+	}
+
+	size_t checked = 0;
+	auto older_than = [&checked](size_t tick) {
+		return [&checked, tick](const size_t& value) {
+			++checked;
+			return value < tick;
+		};
+	};
+	ASSERT_EQ(b.expire_older_than(start + 3s, older_than(3)), 24);
+	ASSERT_EQ(checked, 16);
+	ASSERT_EQ(*b.begin(), 3);
+
+	// A reused hole makes its block newer, so it survives the next sweep.
+	b.set_insert_time(start + 9s);
+	b.insert(9);
+	checked = 0;
+	ASSERT_EQ(b.expire_older_than(start + 4s, older_than(4)), 8);
+	ASSERT_EQ(checked, 9);
+	ASSERT_EQ(b.size(), 64 - 24 - 8 + 1);
+	for (size_t value : b)
+		ASSERT_GE(value, 4);
+}
+
 int main(int argc, char **argv)
 {
 	::testing::InitGoogleTest(&argc, argv);